@@ -1,7 +1,16 @@
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "bytefile.h"
 #include "../runtime/runtime_common.h"
 #include "../runtime/runtime.h"
 
+/* The size (in bytes) of the string table size, global area size and public symbols number fields */
+static constexpr size_t HEADER_SIZE = 3 * sizeof(int);
+
 /* Gets a string from a string table by an index */
 char *get_string(bytefile *f, const int pos) {
     if (pos < 0 || pos > f->stringtab_size) {
@@ -26,32 +35,34 @@ int get_public_offset(bytefile *f, const int i) {
     return f->public_ptr[i * 2 + 1];
 }
 
-bytefile *readFile(const std::string &filename) {
-    FILE *f = fopen(filename.c_str(), "rb");
-    long size;
-    bytefile *bf{};
-
-    if (f == nullptr) {
-        failure("%s\n", strerror(errno));
-    }
-
-    if (fseek(f, 0, SEEK_END) == -1) {
-        failure("%s\n", strerror(errno));
+/* Gets the offset a code offset has in the file the bytefile was made of */
+long get_original_offset(bytefile *f, const long offset) {
+    if (f->origins == nullptr || offset < 0 || offset > f->code_size) {
+        return offset;
     }
+    return f->origins[offset];
+}
 
-    bf = static_cast<bytefile *>(malloc(sizeof(bytefile) + (size = ftell(f))));
+/* Checks the header of the contents of a bytecode file of the given size, and makes a bytefile pointing into them */
+static bytefile *setUp(char *contents, const long size, const bool mapped) {
+    auto *bf = static_cast<bytefile *>(malloc(sizeof(bytefile)));
 
     if (bf == nullptr) {
         failure("*** FAILURE: unable to allocate memory.\n");
     }
 
-    rewind(f);
+    bf->contents = contents;
+    bf->size = size;
+    bf->mapped = mapped;
+    bf->origins = nullptr;
 
-    if (size != fread(&bf->stringtab_size, 1, size, f)) {
-        failure("%s\n", strerror(errno));
+    if (size < static_cast<long>(HEADER_SIZE)) {
+        failure("Incorrect bytecode file format: truncated header");
     }
 
-    fclose(f);
+    memcpy(&bf->stringtab_size, contents, sizeof(int));
+    memcpy(&bf->global_area_size, contents + sizeof(int), sizeof(int));
+    memcpy(&bf->public_symbols_number, contents + 2 * sizeof(int), sizeof(int));
 
     if (bf->global_area_size < 0) {
         failure("Incorrect bytecode file format: negative global area size");
@@ -65,15 +76,15 @@ bytefile *readFile(const std::string &filename) {
         failure("Incorrect bytecode file format: negative number of public symbols");
     }
 
-    if (bf->public_symbols_number * 2 * sizeof(int) + bf->stringtab_size > size) {
+    if (HEADER_SIZE + bf->public_symbols_number * 2 * sizeof(int) + bf->stringtab_size > size) {
         failure("Incorrect bytecode file format: insufficient string or public section");
     }
 
-    bf->string_ptr = &bf->buffer[bf->public_symbols_number * 2 * sizeof(int)];
-    bf->public_ptr = (int *) bf->buffer;
+    bf->public_ptr = (int *) &contents[HEADER_SIZE];
+    bf->string_ptr = &contents[HEADER_SIZE + bf->public_symbols_number * 2 * sizeof(int)];
     bf->code_ptr = &bf->string_ptr[bf->stringtab_size];
-    bf->global_ptr = (int *) malloc(bf->global_area_size * sizeof(int));
-    bf->code_size = size - ((long)bf->code_ptr - (long)&bf->stringtab_size);
+    bf->global_ptr = (int *) calloc(bf->global_area_size, sizeof(int));
+    bf->code_size = size - (bf->code_ptr - contents);
 
     bf->entrypoint_ptr = nullptr;
     for (int i = 0; i < bf->public_symbols_number; i++) {
@@ -94,3 +105,54 @@ bytefile *readFile(const std::string &filename) {
 
     return bf;
 }
+
+bytefile *readFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st{};
+
+    if (fd == -1) {
+        failure("%s\n", strerror(errno));
+    }
+
+    if (fstat(fd, &st) == -1) {
+        failure("%s\n", strerror(errno));
+    }
+
+    if (st.st_size < static_cast<long>(HEADER_SIZE)) {
+        failure("Incorrect bytecode file format: truncated header");
+    }
+
+    /* Private and read-only, so that processes running the same file share its pages through the page cache */
+    void *contents = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (contents == MAP_FAILED) {
+        failure("%s\n", strerror(errno));
+    }
+
+    close(fd);
+
+    return setUp(static_cast<char *>(contents), st.st_size, true);
+}
+
+bytefile *makeBytefile(const char *contents, const long size) {
+    auto *copy = static_cast<char *>(malloc(size));
+
+    if (copy == nullptr) {
+        failure("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    memcpy(copy, contents, size);
+
+    return setUp(copy, size, false);
+}
+
+void closeFile(bytefile *bf) {
+    if (bf->mapped) {
+        munmap(bf->contents, bf->size);
+    } else {
+        free(bf->contents);
+    }
+    free(bf->origins);
+    free(bf->global_ptr);
+    free(bf);
+}
@@ -8,11 +8,15 @@ struct bytefile {
     char *string_ptr; /* A pointer to the beginning of the string table */
     int *public_ptr; /* A pointer to the beginning of publics table    */
     char *code_ptr; /* A pointer to the bytefile itself               */
-    int *global_ptr; /* A pointer to the global area                   */
+    int *global_ptr; /* A pointer to the global area, allocated apart   */
     int stringtab_size; /* The size (in bytes) of the string table        */
     int global_area_size; /* The size (in words) of global area             */
     int public_symbols_number; /* The number of public symbols                   */
-    char buffer[0];
+    char *contents; /* The contents of the file, header included      */
+    long size; /* The size (in bytes) of the contents            */
+    bool mapped; /* Whether the contents are mapped read-only      */
+    int *origins; /* Original offset of every code offset of a file
+                     laid out again, or null                       */
 };
 
 /* Gets a string from a string table by an index */
@@ -24,6 +28,16 @@ char *get_public_name(bytefile *f, int i);
 /* Gets an offset for a public symbol */
 int get_public_offset(bytefile *f, int i);
 
+/* Gets the offset a code offset has in the file the bytefile was made of */
+long get_original_offset(bytefile *f, long offset);
+
+/* Maps a bytecode file read-only, without copying it */
 bytefile *readFile(const std::string &filename);
 
+/* Makes a bytefile of a copy of the contents of a bytecode file */
+bytefile *makeBytefile(const char *contents, long size);
+
+/* Releases a bytefile, its contents and its global area */
+void closeFile(bytefile *bf);
+
 #endif //VIRTUAL_MACHINES_BYTEFILE_H
@@ -0,0 +1,4 @@
+1
+0
+2
+5
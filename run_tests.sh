@@ -1,19 +1,34 @@
 #!/usr/bin/env bash
 set -euo pipefail
 
-# Usage: ./run_tests.sh
+# Usage: ./run_tests.sh [variant...]
 # Requirements:
 # - lamac available in PATH
-# - CMake and Make available
+# - CMake, Make and a C compiler available
 # - Project sources for lama_interpreter in current directory
+#
+# Every test is run in each of the variants below, or only in the ones given as arguments, and its output is compared
+# to the one of `lamac -i`:
+# - default, checked, switch, register, jit, trace: lama_interpreter with no flags, --checked, --engine=switch,
+#   --engine=register, --jit and --trace;
+# - opt: lama_interpreter on the output of lama_opt;
+# - aot: the C file lama_aot produces, built against the runtime; tests whose bytecode fails verification are skipped.
+#
+# Tests of instructions lamac does not emit are written as bytecode files, in regression/bytecode, and their outputs
+# are compared to the .sol file next to them instead.
 
 # I shamelessly declare that this script was produced with the help of chatgpt :)
 
 LAMA_ROOT="."
+VARIANTS=(default checked switch register jit trace opt aot)
+if [[ $# -gt 0 ]]; then
+  VARIANTS=("$@")
+fi
 DIRS=(
   "regression/regression"
   "regression/deep-expressions"
   "regression/expressions"
+  "regression/bytecode"
 )
 
 BUILD_DIR="build"
@@ -27,17 +42,80 @@ if [[ ! -x "./lama_interpreter" ]]; then
   exit 1
 fi
 LAMA_INTERPRETER="$(pwd)/lama_interpreter"
+LAMA_OPT="$(pwd)/lama_opt"
+LAMA_AOT="$(pwd)/lama_aot"
 popd >/dev/null
 
 OUT_DIR="output"
 mkdir -p "$OUT_DIR"
 
+# The runtime is built once for all the programs compiled ahead of time
+RUNTIME_DIR="$(pwd)/runtime"
+RUNTIME_OBJS=()
+if [[ " ${VARIANTS[*]} " == *" aot "* ]]; then
+  mkdir -p "$OUT_DIR/runtime"
+  for src in runtime gc; do
+    cc -O2 -c "$RUNTIME_DIR/$src.c" -o "$OUT_DIR/runtime/$src.o"
+    RUNTIME_OBJS+=("$(pwd)/$OUT_DIR/runtime/$src.o")
+  done
+fi
+
 total_tests=0
-passed_tests=0
+declare -A passed_tests skipped_tests
+for variant in "${VARIANTS[@]}"; do
+  passed_tests[$variant]=0
+  skipped_tests[$variant]=0
+done
+
+# Runs the bytecode file of a test in a variant, with the input of the test if it has one. Returns 2 if the variant
+# does not apply to the test, 1 if the program could not be built and 3 if it was killed by a signal.
+run_variant() {
+  local variant="$1" bc="$2" input_file="$3" out_file="$4" err_file="$5"
+  local cmd
+  : > "$err_file"
+  case "$variant" in
+    default) cmd=("$LAMA_INTERPRETER" "$bc") ;;
+    checked) cmd=("$LAMA_INTERPRETER" --checked "$bc") ;;
+    switch) cmd=("$LAMA_INTERPRETER" --engine=switch "$bc") ;;
+    register) cmd=("$LAMA_INTERPRETER" --engine=register "$bc") ;;
+    jit) cmd=("$LAMA_INTERPRETER" --jit "$bc") ;;
+    trace) cmd=("$LAMA_INTERPRETER" --trace "$bc") ;;
+    opt)
+      "$LAMA_OPT" "$bc" "${bc%.bc}.opt.bc" > /dev/null 2> "$err_file" || return 1
+      cmd=("$LAMA_INTERPRETER" "${bc%.bc}.opt.bc")
+      ;;
+    aot)
+      if ! "$LAMA_AOT" "$bc" "${bc%.bc}.c" 2> "$err_file"; then
+        grep -q "fails verification" "$err_file" && return 2
+        return 1
+      fi
+      cc -O2 -I"$RUNTIME_DIR" "${bc%.bc}.c" "${RUNTIME_OBJS[@]}" -o "${bc%.bc}.aot" 2> "$err_file" || return 1
+      cmd=("${bc%.bc}.aot")
+      ;;
+    *)
+      echo "Error: unknown variant $variant"
+      exit 1
+      ;;
+  esac
+
+  local rc=0
+  if [[ -f "$input_file" ]]; then
+    "${cmd[@]}" < "$input_file" > "$out_file" 2>> "$err_file" || rc=$?
+  else
+    "${cmd[@]}" < /dev/null > "$out_file" 2>> "$err_file" || rc=$?
+  fi
+  if [[ $rc -gt 128 ]]; then
+    echo "ERROR: $variant was killed by signal $((rc - 128)) for $bc"
+    return 3
+  elif [[ $rc -ne 0 ]]; then
+    echo "ERROR: $variant returned $rc for $bc"
+  fi
+  return 0
+}
 
 run_test() {
   local lama_file="$1"
-  local base="$(basename "$lama_file" .lama)"
+  local base="$(basename "${lama_file%.*}")"
   local dir_rel
   dir_rel="$(dirname "${lama_file#${LAMA_ROOT}/}")"
   local out_subdir="$OUT_DIR/$dir_rel"
@@ -46,11 +124,14 @@ run_test() {
   local input_file="$(dirname "$lama_file")/$base.input"
   local bc_in_out="$out_subdir/$base.bc"
   local sol_file="$out_subdir/$base.sol"
-  local out_file="$out_subdir/$base.out"
-  local err_file="$out_subdir/$base.err"
 
   echo "running test $base"
 
+  if [[ "$lama_file" == *.bc ]]; then
+    cp "$lama_file" "$bc_in_out"
+    cp "${lama_file%.bc}.sol" "$sol_file"
+  fi
+
   if [[ ! -f "$bc_in_out" ]]; then
     pushd "$out_subdir" >/dev/null
     if ! lamac -b "../../../$lama_file"; then
@@ -73,24 +154,30 @@ run_test() {
     fi
   fi
 
-  if [[ -f "$input_file" ]]; then
-    if ! "$LAMA_INTERPRETER" "$bc_in_out" < "$input_file" > "$out_file" 2> "$err_file"; then
-      rc=$?
-      echo "ERROR: interpreter returned $rc for $lama_file"
-    fi
-  else
-    if ! "$LAMA_INTERPRETER" "$bc_in_out" > "$out_file" 2> "$err_file"; then
-      rc=$?
-      echo "ERROR: interpreter returned $rc for $lama_file (no input)"
+  local ok=1
+  for variant in "${VARIANTS[@]}"; do
+    local out_file="$out_subdir/$base.$variant.out"
+    local err_file="$out_subdir/$base.$variant.err"
+    local status=0
+    run_variant "$variant" "$bc_in_out" "$input_file" "$out_file" "$err_file" || status=$?
+    if [[ $status -eq 2 ]]; then
+      skipped_tests[$variant]=$((skipped_tests[$variant] + 1))
+    elif [[ $status -eq 3 ]]; then
+      ok=0
+    elif [[ $status -ne 0 ]]; then
+      ok=0
+      echo "ERROR: could not build the $variant program for $lama_file"
+      echo "  cat $err_file"
+    elif diff -q "$sol_file" "$out_file" >/dev/null 2>&1; then
+      passed_tests[$variant]=$((passed_tests[$variant] + 1))
+    else
+      ok=0
+      echo "ERROR: $variant output mismatch for $lama_file"
+      echo "  diff $sol_file $out_file"
     fi
-  fi
-
-  if diff -q "$sol_file" "$out_file" >/dev/null 2>&1; then
-    passed_tests=$((passed_tests + 1))
+  done
+  if [[ $ok -eq 1 ]]; then
     echo "Ok"
-  else
-    echo "ERROR: output mismatch for $lama_file"
-    echo "  diff $sol_file $out_file"
   fi
 }
 
@@ -101,7 +188,7 @@ for rel in "${DIRS[@]}"; do
     continue
   fi
   shopt -s nullglob
-  files=("$test_dir"/*.lama)
+  files=("$test_dir"/*.lama "$test_dir"/*.bc)
   for f in "${files[@]}"; do
     total_tests=$((total_tests + 1))
     run_test "$f"
@@ -109,5 +196,11 @@ for rel in "${DIRS[@]}"; do
 done
 
 echo "Total tests: $total_tests"
-echo "Passed: $passed_tests"
+for variant in "${VARIANTS[@]}"; do
+  if [[ ${skipped_tests[$variant]} -gt 0 ]]; then
+    echo "Passed ($variant): ${passed_tests[$variant]}, skipped: ${skipped_tests[$variant]}"
+  else
+    echo "Passed ($variant): ${passed_tests[$variant]}"
+  fi
+done
 exit 0
@@ -62,10 +62,22 @@ typedef struct {
   size_t  size;
 } memory_chunk;
 
+// the heap objects are bump-allocated from, also by the inline allocation of the interpreter
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern memory_chunk heap;
+#ifdef __cplusplus
+}
+#endif
+
 // the only GC-related function that should be exposed, others are useful for tests and internal implementation
 // allocates object of the given size on the heap
 void *alloc(size_t);
 // takes number of words as a parameter
+#ifdef __cplusplus
+extern "C"
+#endif
 void *gc_alloc(size_t);
 // takes number of words as a parameter
 void *gc_alloc_on_existing_heap(size_t);
@@ -213,7 +213,7 @@ static char *chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234
 
 extern char *de_hash (aint);
 
-extern aint LtagHash (char *s) {
+static aint tag_hash (char *s, int strict) {
   char *p;
   aint   h = 0, limit = 0;
 
@@ -226,19 +226,35 @@ extern aint LtagHash (char *s) {
       ;
 
     if (*q) h = (h << 6) | pos;
-    else failure("tagHash: character not found: %c\n", *p);
+    else if (strict) failure("tagHash: character not found: %c\n", *p);
+    else return 0;
 
     p++;
   }
 
-  if (strncmp(s, de_hash(h), MAX_SEXP_TAGLEN) != 0) { failure("%s <-> %s\n", s, de_hash(h)); }
+  if (strncmp(s, de_hash(h), MAX_SEXP_TAGLEN) != 0) {
+    if (strict) failure("%s <-> %s\n", s, de_hash(h));
+    return 0;
+  }
 
   return BOX(h);
 }
 
+extern aint LtagHash (char *s) { return tag_hash(s, 1); }
+
+// Same as LtagHash, but returns 0 for an invalid tag instead of failing
+extern aint LtagTryHash (char *s) { return tag_hash(s, 0); }
+
+// Names of known tags, looked up before decoding a hash into the static buffer
+char *(*de_hash_lookup) (aint) = NULL;
+
 char *de_hash (aint n) {
   static char buf[MAX_SEXP_TAGLEN + 1] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
+  if (de_hash_lookup != NULL) {
+    char *name = de_hash_lookup(n);
+    if (name != NULL) { return name; }
+  }
   p                  = &buf[MAX_SEXP_TAGLEN];
 
   *p-- = 0;
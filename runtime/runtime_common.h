@@ -104,6 +104,9 @@ void *Lstring (aint* args /* void *p */);
 void *Barray (aint* args, aint bn);
 void *Bstring (aint* args);
 aint LtagHash (char *);
+aint LtagTryHash (char *);
+char *de_hash (aint);
+extern char *(*de_hash_lookup) (aint);
 aint Btag (void *d, aint t, aint n);
 aint Barray_patt (void *d, aint n);
 aint Bstring_patt (void *x, void *y);
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <stack>
 #include <unordered_set>
 #include <vector>
 
@@ -0,0 +1,543 @@
+#include <fstream>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "devirtualizer.h"
+#include "threaded.h"
+#include "verifier.h"
+#include "../bytecode/bytefile.h"
+
+// Compiles verified bytecode ahead of time into a C translation unit, to be built with the system C compiler and
+// linked against the runtime and the collector:
+//   cc -O2 -Iruntime <output>.c runtime/runtime.c runtime/gc.c
+// Every function becomes a C function taking the address of its last argument on the operand stack and the address
+// of the top of its frame, which is its first argument or the closure passed below the arguments, with its
+// instructions translated one by one into straight-line code and jumps into gotos. Values live on the same stack the
+// interpreter uses, where the collector finds them: the verifier knows the depth of the operand stack at every
+// instruction, so each value has a fixed slot relative to the frame, and the top of the stack is only published to
+// the collector before instructions that may allocate. The C stack holds the return addresses instead of frame
+// records; the program allocates it, and every function checks it along with the operand stack. Closures hold the
+// address of the C function of their code, which closure calls look up in the table of the functions closures are
+// made of to check that the closure accepts the call, as the interpreter checks the entry of a closure; every call
+// site caches the last function it checked. Calls of a function to itself in tail position reuse its frame, and
+// other tail calls move their arguments to the top of the frame of the caller, so the operand stack does not grow on
+// tail calls either way. They then return to the call that entered the caller, which calls their target in a loop,
+// so the C stack does not grow either, whatever the C compiler optimizes.
+struct AotCompiler {
+    ThreadedCode &code;
+    const Verifier &verifier;
+    std::ostream &out;
+    std::vector<bool> labels; // instructions that are jumped to
+    std::vector<int> sites; // closure call site -> number of its cache of the function it last checked
+
+    AotCompiler(ThreadedCode &code, const Verifier &verifier, std::ostream &out)
+        : code(code), verifier(verifier), out(out), labels(code.insns.size(), false), sites(code.insns.size(), -1) {
+        for (auto &insn: code.insns) {
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                labels[index(insn.target)] = true;
+            }
+        }
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    int offset(const Decoded *insn) const {
+        return static_cast<int>(insn->ip - code.bf->code_ptr);
+    }
+
+    std::string function(const Decoded *begin) const {
+        return "f_" + std::to_string(index(begin));
+    }
+
+    // Value `k` of the operand stack, counting from the bottom; locals are above the operand stack and arguments
+    // above the locals
+    static std::string slot(int k) {
+        return "s[" + std::to_string(-k) + "]";
+    }
+
+    static std::string address(int k) {
+        return k < 0 ? "s + " + std::to_string(-k) : "s - " + std::to_string(k);
+    }
+
+    std::string string(const char *str) const {
+        return "strings + " + std::to_string(str - code.bf->string_ptr);
+    }
+
+    static std::string location(Loc::Type type, int value, const Decoded &begin) {
+        switch (type) {
+            case Loc::Type::G:
+                return "globals[" + std::to_string(value) + "]";
+            case Loc::Type::L:
+                return "sp[" + std::to_string(-1 - value) + "]";
+            case Loc::Type::A:
+                return "sp[" + std::to_string(begin.a - 1 - value) + "]";
+            case Loc::Type::C:
+                return "((aint *) sp[" + std::to_string(begin.a) + "])[" + std::to_string(value + 1) + "]";
+        }
+        return {};
+    }
+
+    static Loc::Type locType(Op op, Op base) {
+        return static_cast<Loc::Type>(static_cast<int>(op) - static_cast<int>(base));
+    }
+
+    void prelude() {
+        auto *bf = code.bf;
+        out << "// Generated by lama_aot\n"
+               "#include \"gc.h\"\n"
+               "#include \"runtime.h\"\n"
+               "#include <stdlib.h>\n"
+               "#include <ucontext.h>\n"
+               "\n"
+               "#define VSTACK_SIZE (1 << 20)\n"
+               "#define CSTACK_SIZE (VSTACK_SIZE * 64)\n"
+               "#define CSTACK_RESERVE (1 << 16)\n"
+               "#define ARITH(x, op, y) BOX((aint) ((auint) UNBOX(x) op (auint) UNBOX(y)))\n"
+               "#define COMPARE(x, op, y) BOX(UNBOX(x) op UNBOX(y))\n"
+               "\n"
+               "extern aint *__gc_stack_top, *__gc_stack_bottom;\n"
+               "\n"
+               "typedef aint (*function)(aint *, aint *);\n"
+               "\n"
+               "static aint vstack[VSTACK_SIZE];\n"
+               "static aint *globals;\n"
+               "static char *cstack_limit;\n"
+               "static function pending;\n"
+               "static aint *pending_sp, *pending_top;\n"
+               "static __attribute__((unused)) char strings[] = {";
+        for (int i = 0; i < bf->stringtab_size; i++) {
+            out << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(bf->string_ptr[i]) << ",";
+        }
+        out << "\n    0\n};\n"
+               "\n"
+               "static inline aint call(function f, aint *sp, aint *top) {\n"
+               "    aint result = f(sp, top);\n"
+               "    while (pending != NULL) {\n"
+               "        function g = pending;\n"
+               "        pending = NULL;\n"
+               "        result = g(pending_sp, pending_top);\n"
+               "    }\n"
+               "    return result;\n"
+               "}\n"
+               "\n"
+               "static __attribute__((unused)) aint divide(aint x, aint y, int mod) {\n"
+               "    if (UNBOX(y) == 0) {\n"
+               "        failure(\"Attempt to divide %\" PRIdAI \" by zero when executing operation %s\", UNBOX(x),\n"
+               "                mod ? \"%\" : \"/\");\n"
+               "    }\n"
+               "    return BOX(mod ? UNBOX(x) % UNBOX(y) : UNBOX(x) / UNBOX(y));\n"
+               "}\n"
+               "\n";
+    }
+
+    // Translates a straight-line instruction whose operand stack holds `d` values
+    void straight(const Decoded &insn, const Decoded &begin, int d) {
+        auto top = slot(d - 1), second = slot(d - 2), next = slot(d);
+        auto publish = "__gc_stack_top = " + address(d) + "; ";
+        auto binop = [&](const char *macro, const char *op) {
+            out << second << " = " << macro << "(" << second << ", " << op << ", " << top << ");";
+        };
+        switch (insn.op) {
+            case Op::NOP: case Op::DROP:
+                out << ";";
+                return;
+            case Op::SWAP:
+                out << "{ aint t = " << top << "; " << top << " = " << second << "; " << second << " = t; }";
+                return;
+            case Op::ADD: case Op::ADD_INT: return binop("ARITH", "+");
+            case Op::SUB: case Op::SUB_INT: return binop("ARITH", "-");
+            case Op::MUL: case Op::MUL_INT: return binop("ARITH", "*");
+            case Op::LT: case Op::LT_INT: return binop("COMPARE", "<");
+            case Op::LTQ: case Op::LTQ_INT: return binop("COMPARE", "<=");
+            case Op::GT: case Op::GT_INT: return binop("COMPARE", ">");
+            case Op::GTQ: case Op::GTQ_INT: return binop("COMPARE", ">=");
+            case Op::EQ: case Op::EQ_INT: return binop("COMPARE", "==");
+            case Op::NEQ: case Op::NEQ_INT: return binop("COMPARE", "!=");
+            case Op::AND: return binop("COMPARE", "&&");
+            case Op::OR: return binop("COMPARE", "||");
+            case Op::DIV:
+            case Op::MOD:
+                out << second << " = divide(" << second << ", " << top << ", " << (insn.op == Op::MOD) << ");";
+                return;
+            case Op::CONST:
+                out << next << " = BOX(" << insn.a << ");";
+                return;
+            case Op::STRING:
+                out << "{ char *str = " << string(insn.str) << "; " << publish << next
+                    << " = (aint) Bstring((aint *) &str); }";
+                return;
+            case Op::SEXP: {
+                out << next << " = ";
+                if (insn.cache != 0) {
+                    out << insn.cache << "; ";
+                } else {
+                    out << "LtagHash(" << string(insn.str) << "); ";
+                }
+                out << "__gc_stack_top = " << address(d + 1) << "; " << slot(d - insn.a) << " = (aint) Bsexp("
+                    << address(d) << ", BOX(" << insn.a + 1 << "));";
+                return;
+            }
+            case Op::STI:
+                out << "failure(\"Unsupported instruction STI\");";
+                return;
+            case Op::STA:
+                out << publish << slot(d - 3) << " = (aint) Bsta((void *) " << slot(d - 3) << ", " << second
+                    << ", (void *) " << top << ");";
+                return;
+            case Op::RET:
+                out << "failure(\"RET is not supported\");";
+                return;
+            case Op::LDA:
+                out << "failure(\"LDA is not supported\");";
+                return;
+            case Op::DUP:
+                out << next << " = " << top << ";";
+                return;
+            case Op::ELEM:
+                out << publish << second << " = (aint) Belem((void *) " << second << ", " << top << ");";
+                return;
+            case Op::LD_G: case Op::LD_L: case Op::LD_A: case Op::LD_C:
+                out << next << " = " << location(locType(insn.op, Op::LD_G), insn.a, begin) << ";";
+                return;
+            case Op::ST_G: case Op::ST_L: case Op::ST_A: case Op::ST_C:
+                out << location(locType(insn.op, Op::ST_G), insn.a, begin) << " = " << top << ";";
+                return;
+            case Op::CLOSURE: {
+                auto *entry = code.entry(insn.jump);
+                for (int j = 0; j < insn.a; j++) {
+                    out << slot(d + j) << " = " << location(insn.locs[j].type, insn.locs[j].value, begin) << "; ";
+                }
+                out << slot(d + insn.a) << " = (aint) &" << function(entry) << "; __gc_stack_top = "
+                    << address(d + insn.a + 1) << "; " << next << " = (aint) Bclosure(" << address(d + insn.a)
+                    << ", BOX(" << insn.a << "));";
+                return;
+            }
+            case Op::TAG:
+                out << top << " = Btag((void *) " << top << ", ";
+                if (insn.cache != 0) {
+                    out << insn.cache;
+                } else {
+                    out << "LtagHash(" << string(insn.str) << ")";
+                }
+                out << ", BOX(" << insn.a << "));";
+                return;
+            case Op::ARRAY:
+                out << top << " = Barray_patt((void *) " << top << ", BOX(" << insn.a << "));";
+                return;
+            case Op::FAIL:
+                out << "failure(\"Failed at %d %d\", " << insn.a << ", " << insn.b << ");";
+                return;
+            case Op::PATT_STR:
+                out << second << " = Bstring_patt((void *) " << top << ", (void *) " << second << ");";
+                return;
+            case Op::PATT_STR_TAG:
+                out << top << " = Bstring_tag_patt((void *) " << top << ");";
+                return;
+            case Op::PATT_ARRAY:
+                out << top << " = Barray_tag_patt((void *) " << top << ");";
+                return;
+            case Op::PATT_SEXP:
+                out << top << " = Bsexp_tag_patt((void *) " << top << ");";
+                return;
+            case Op::PATT_BOXED:
+                out << top << " = BOX(!UNBOXED(" << top << "));";
+                return;
+            case Op::PATT_UNBOXED:
+                out << top << " = BOX(UNBOXED(" << top << "));";
+                return;
+            case Op::PATT_CLOSURE:
+                out << top << " = Bclosure_tag_patt((void *) " << top << ");";
+                return;
+            case Op::PATT:
+                out << "failure(\"Unexpected pattern %d\", " << insn.a << ");";
+                return;
+            case Op::LREAD:
+                out << next << " = Lread();";
+                return;
+            case Op::LWRITE:
+                out << top << " = Lwrite(" << top << ");";
+                return;
+            case Op::LLENGTH:
+                out << top << " = Llength((void *) " << top << ");";
+                return;
+            case Op::LSTRING:
+                out << publish << next << " = (aint) Lstring(" << address(d - 1) << ");";
+                return;
+            case Op::BARRAY:
+                out << publish << slot(d - insn.a) << " = (aint) Barray(" << address(d - 1) << ", BOX(" << insn.a
+                    << "));";
+                return;
+            default:
+                std::cerr << "Cannot compile instruction " << static_cast<int>(insn.op) << " at "
+                          << offset(&insn) << "\n";
+                exit(1);
+        }
+    }
+
+    // Functions closures are made of, with what they accept, and the caches of the closure call sites, followed by
+    // the function that checks the closure a call site calls and returns its C function
+    void closures(const std::vector<int> &entries, int nsites) {
+        std::vector<int> closed(code.insns.size(), -1); // function -> bytecode offset closures hold
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (verifier.owner[i] >= 0 && code.insns[i].op == Op::CLOSURE) {
+                closed[index(code.entry(code.insns[i].jump))] = code.insns[i].jump;
+            }
+        }
+        out << "struct site {\n"
+               "    aint code;\n"
+               "    int captures;\n"
+               "    int offset;\n"
+               "};\n"
+               "\n"
+               "static const struct {\n"
+               "    aint code;\n"
+               "    int nargs;\n"
+               "    int captures;\n"
+               "    int offset;\n"
+               "} closures[] = {\n";
+        for (auto e: entries) {
+            if (closed[e] >= 0) {
+                auto &begin = code.insns[e];
+                out << "    {(aint) &" << function(&begin) << ", " << begin.a << ", " << begin.c << ", "
+                    << get_original_offset(code.bf, closed[e]) << "},\n";
+            }
+        }
+        out << "    {0, 0, 0, 0}\n"
+               "};\n"
+               "\n"
+               "static struct site sites[" << nsites << "];\n"
+               "\n"
+               "static function callee(aint closure, int nargs, struct site *site) {\n"
+               "    if (UNBOXED(closure) || TAG(TO_DATA(closure)->data_header) != CLOSURE_TAG) {\n"
+               "        failure(\"Called value is not a closure\");\n"
+               "    }\n"
+               "    aint code = ((aint *) closure)[0];\n"
+               "    if (code != site->code) {\n"
+               "        int i = 0;\n"
+               "        while (closures[i].code != 0 && closures[i].code != code) {\n"
+               "            i++;\n"
+               "        }\n"
+               "        if (closures[i].code == 0) {\n"
+               "            failure(\"Closure target is not a function\");\n"
+               "        }\n"
+               "        if (closures[i].nargs != nargs) {\n"
+               "            failure(\"Closure at %.8x does not accept %d arguments\", closures[i].offset, nargs);\n"
+               "        }\n"
+               "        site->code = code;\n"
+               "        site->captures = closures[i].captures;\n"
+               "        site->offset = closures[i].offset;\n"
+               "    }\n"
+               "    if ((int) LEN(TO_DATA(closure)->data_header) - 1 < site->captures) {\n"
+               "        failure(\"Closure at %.8x does not accept %d arguments\", site->offset, nargs);\n"
+               "    }\n"
+               "    return (function) code;\n"
+               "}\n"
+               "\n";
+    }
+
+    // Checked C function of the closure below the arguments of the closure call site `insn` at depth `d`
+    std::string callee(const Decoded &insn, int d) const {
+        return "callee(" + slot(d - insn.a - 1) + ", " + std::to_string(insn.a) + ", &sites[" +
+               std::to_string(sites[index(&insn)]) + "])";
+    }
+
+    // Moves the `n` values a tail call passes, the arguments and possibly a closure below them, to the top of the frame
+    // of the caller, through temporaries as the two areas may overlap, and sets `to` to the last argument. The call
+    // itself is left to `call`, once the caller has returned.
+    void tail(int n, int d) {
+        out << "aint *to = top - " << n - 1 << "; ";
+        for (int j = 0; j < n; j++) {
+            out << "aint t" << j << " = " << slot(d - n + j) << "; ";
+        }
+        for (int j = 0; j < n; j++) {
+            out << "to[" << n - 1 - j << "] = t" << j << "; ";
+        }
+    }
+
+    void instruction(const Decoded &insn, const Decoded &begin, int entry) {
+        auto i = index(&insn);
+        auto d = verifier.depth[i];
+        if (labels[i]) {
+            out << "L" << i << ":\n";
+        }
+        out << "    ";
+        auto args = address(d - 1); // the callee finds its arguments above this address, and its locals below
+        switch (insn.op) {
+            case Op::JMP:
+                out << "goto L" << index(insn.target) << ";";
+                break;
+            case Op::CJMPZ:
+            case Op::CJMPNZ:
+                out << "if (" << (insn.op == Op::CJMPZ ? "!" : "") << "UNBOX(" << slot(d - 1) << ")) goto L"
+                    << index(insn.target) << ";";
+                break;
+            case Op::CALL:
+                out << slot(d - insn.a - insn.b) << " = call(" << function(insn.target) << ", " << args << ", "
+                    << address(d - insn.a - insn.b) << ");";
+                break;
+            case Op::CALLC:
+                out << slot(d - insn.a - 1) << " = call(" << callee(insn, d) << ", " << args << ", "
+                    << address(d - insn.a - 1) << ");";
+                break;
+            case Op::TAIL_CALL:
+                if (index(insn.target) == entry) {
+                    // the closure of a function that reads captures is always passed, so it has a slot to reuse
+                    for (int j = 0; j < insn.a; j++) {
+                        out << location(Loc::Type::A, j, begin) << " = " << slot(d - insn.a + j) << "; ";
+                    }
+                    if (insn.b != 0 && begin.c > 0) {
+                        out << "sp[" << begin.a << "] = " << slot(d - insn.a - 1) << "; ";
+                    }
+                    out << "goto begin;";
+                } else {
+                    out << "{ ";
+                    tail(insn.a + insn.b, d);
+                    out << "pending = " << function(insn.target) << "; ";
+                    out << "pending_sp = to; pending_top = top; return 0; }";
+                }
+                break;
+            case Op::TAIL_CALLC:
+                out << "{ function f = " << callee(insn, d) << "; ";
+                tail(insn.a + 1, d);
+                out << "pending = f; pending_sp = to; pending_top = top; return 0; }";
+                break;
+            case Op::END:
+                out << "return " << slot(d - 1) << ";";
+                break;
+            default:
+                straight(insn, begin, d);
+                break;
+        }
+        out << "\n";
+    }
+
+    // Instructions of the function starting at `entry`: the ones after its BEGIN, which it starts with, then the ones
+    // laid out before it, which are only entered by jumps
+    std::vector<int> body(int entry) const {
+        std::vector<int> body;
+        for (auto i = entry + 1; i < static_cast<int>(code.insns.size()); i++) {
+            if (verifier.owner[i] == entry) {
+                body.push_back(i);
+            }
+        }
+        for (auto i = 0; i < entry; i++) {
+            if (verifier.owner[i] == entry) {
+                body.push_back(i);
+            }
+        }
+        return body;
+    }
+
+    void compile(int entry) {
+        auto &begin = code.insns[entry];
+        auto body = this->body(entry);
+        auto loops = false;
+        auto moves = false; // whether a tail call moves its arguments to the top of the frame
+        for (auto i: body) {
+            auto &insn = code.insns[i];
+            loops |= insn.op == Op::TAIL_CALL && index(insn.target) == entry;
+            moves |= (insn.op == Op::TAIL_CALL && index(insn.target) != entry) || insn.op == Op::TAIL_CALLC;
+        }
+        out << "static aint " << function(&begin) << "(aint *sp, aint *top) {\n"
+            << "    aint *s = sp - " << begin.b + 1 << ";\n"
+            << "    if (s - " << begin.depth << " <= vstack || (char *) __builtin_frame_address(0) < cstack_limit) {\n"
+            << "        failure(\"Virtual stack overflow!\");\n"
+            << "    }\n"
+            << (moves ? "" : "    (void) top;\n")
+            << (loops ? "begin:\n" : "");
+        for (int j = 0; j < begin.b; j++) {
+            out << "    " << location(Loc::Type::L, j, begin) << " = BOX(0);\n";
+        }
+        for (auto i: body) {
+            instruction(code.insns[i], begin, entry);
+        }
+        out << "}\n\n";
+    }
+
+    void run() {
+        std::vector<int> entries;
+        for (size_t e = 0; e < code.insns.size(); e++) {
+            if (verifier.owner[e] == static_cast<int>(e) && code.insns[e].op == Op::BEGIN) {
+                entries.push_back(static_cast<int>(e));
+            }
+        }
+        auto nsites = 0;
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (verifier.owner[i] >= 0 && (code.insns[i].op == Op::CALLC || code.insns[i].op == Op::TAIL_CALLC)) {
+                sites[i] = nsites++;
+            }
+        }
+        prelude();
+        for (auto e: entries) {
+            out << "static aint " << function(&code.insns[e]) << "(aint *sp, aint *top);\n";
+        }
+        out << "\n";
+        if (nsites > 0) {
+            closures(entries, nsites);
+        }
+        for (auto e: entries) {
+            compile(e);
+        }
+
+        // The globals are at the bottom of the stack, followed by argc and argv, as in the interpreter. The file does not
+        // store their initial values, so they start out zero, as the static stack is. The program runs on a C stack of
+        // its own, large enough for the C frames of the calls that fit in the operand stack, whose end every function
+        // checks along with the operand stack, keeping room for `failure` to report the overflow.
+        auto *main = code.entry(code.bf->entrypoint_ptr - code.bf->code_ptr);
+        out << "static void entry(void) {\n"
+               "    call(" << function(main) << ", globals - 2, globals - 1);\n"
+               "}\n"
+               "\n"
+               "int main() {\n"
+               "    static ucontext_t host, guest;\n"
+               "    char *cstack = malloc(CSTACK_SIZE);\n"
+               "    if (cstack == NULL) {\n"
+               "        failure(\"Cannot allocate the C stack\");\n"
+               "    }\n"
+               "    cstack_limit = cstack + CSTACK_RESERVE;\n"
+               "    __gc_init();\n"
+               "    __gc_stack_bottom = vstack + VSTACK_SIZE - 1;\n"
+               "    globals = __gc_stack_bottom - " << code.bf->global_area_size << ";\n"
+               "    globals[-1] = 0;\n"
+               "    globals[-2] = 0;\n"
+               "    __gc_stack_top = globals - 3;\n"
+               "    getcontext(&guest);\n"
+               "    guest.uc_stack.ss_sp = cstack;\n"
+               "    guest.uc_stack.ss_size = CSTACK_SIZE;\n"
+               "    guest.uc_link = &host;\n"
+               "    makecontext(&guest, entry, 0);\n"
+               "    swapcontext(&host, &guest);\n"
+               "    return 0;\n"
+               "}\n";
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <bytecode-file> <c-file>" << std::endl;
+        return 1;
+    }
+
+    auto *bf = readFile(argv[1]);
+    auto code = decodeThreaded(bf);
+    Verifier verifier(code);
+    if (!verifier.verify()) {
+        std::cerr << "Cannot compile code that fails verification: " << verifier.reason << std::endl;
+        return 1;
+    }
+    devirtualize(code, verifier);
+
+    std::ofstream out(argv[2]);
+    AotCompiler(code, verifier, out).run();
+    if (!out) {
+        std::cerr << "Cannot write " << argv[2] << std::endl;
+        return 1;
+    }
+    closeFile(bf);
+    return 0;
+}
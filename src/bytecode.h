@@ -0,0 +1,349 @@
+#ifndef VIRTUAL_MACHINES_BYTECODE_H
+#define VIRTUAL_MACHINES_BYTECODE_H
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "common.h"
+#include "processor.h"
+#include "../bytecode/bytefile.h"
+
+constexpr unsigned char opcodeOf(Instruction hi, Instruction lo) {
+    return static_cast<unsigned char>(static_cast<int>(hi) << 4 | static_cast<int>(lo));
+}
+
+constexpr static unsigned char OP_CONST = opcodeOf(Instruction::CONST_H, Instruction::CONST);
+constexpr static unsigned char OP_STRING = opcodeOf(Instruction::CONST_H, Instruction::STRING);
+constexpr static unsigned char OP_SEXP = opcodeOf(Instruction::CONST_H, Instruction::SEXP);
+constexpr static unsigned char OP_JMP = opcodeOf(Instruction::CONST_H, Instruction::JMP);
+constexpr static unsigned char OP_END = opcodeOf(Instruction::CONST_H, Instruction::END);
+constexpr static unsigned char OP_DROP = opcodeOf(Instruction::CONST_H, Instruction::DROP);
+constexpr static unsigned char OP_DUP = opcodeOf(Instruction::CONST_H, Instruction::DUP);
+constexpr static unsigned char OP_CJMPZ = opcodeOf(Instruction::CJMP_H, Instruction::CJMPZ);
+constexpr static unsigned char OP_CJMPNZ = opcodeOf(Instruction::CJMP_H, Instruction::CJMPNZ);
+constexpr static unsigned char OP_BEGIN = opcodeOf(Instruction::CJMP_H, Instruction::BEGIN);
+constexpr static unsigned char OP_CLOSURE = opcodeOf(Instruction::CJMP_H, Instruction::CLOSURE);
+constexpr static unsigned char OP_CALL = opcodeOf(Instruction::CJMP_H, Instruction::CALL);
+constexpr static unsigned char OP_TAG = opcodeOf(Instruction::CJMP_H, Instruction::TAG);
+constexpr static unsigned char OP_LINE = opcodeOf(Instruction::CJMP_H, Instruction::LINE);
+
+// Instruction of a bytecode file, with its operands decoded so that rewrites can change them, and its code reference
+// resolved to an instruction, so that the code can be laid out again
+struct BytecodeInsn {
+    unsigned char opcode = 0;
+    std::vector<int> args; // operands in their encoding order, with the captures of CLOSURE as (type, index) pairs
+    int target = -1; // instruction a JMP, CJMPZ, CJMPNZ, CALL or CLOSURE refers to, instead of its first operand
+    bool falls = true; // whether control can pass to the next instruction
+    bool removed = false;
+    int offset = -1; // code offset in the original file, which copies of the instruction keep
+
+    Instruction hi() const { return static_cast<Instruction>(opcode >> 4); }
+    Instruction lo() const { return static_cast<Instruction>(opcode & 0x0F); }
+
+    bool refers() const {
+        return opcode == OP_JMP || opcode == OP_CJMPZ || opcode == OP_CJMPNZ || opcode == OP_CLOSURE ||
+               opcode == OP_CALL;
+    }
+
+    bool jumps() const {
+        return opcode == OP_JMP || opcode == OP_CJMPZ || opcode == OP_CJMPNZ;
+    }
+
+    // Whether the first operand is a string table offset
+    bool names() const {
+        return opcode == OP_STRING || opcode == OP_SEXP || opcode == OP_TAG;
+    }
+};
+
+// Records the instruction `processInstruction` decodes. STOP reaches no handler and is kept as is, as the switch
+// engine skips it.
+struct BytecodeDecoder {
+    BytecodeInsn insn;
+    int reference = -1; // code offset the instruction refers to
+
+    void args(std::initializer_list<int> values) { insn.args.insert(insn.args.end(), values); }
+    int string(ProcessorState &state, const char *str) const { return static_cast<int>(str - state.bf->string_ptr); }
+
+    void processBinop(ProcessorState &, BinOp) {}
+    void processConst(ProcessorState &, int cnst) { args({cnst}); }
+    void processString(ProcessorState &state, char *str) { args({string(state, str)}); }
+    void processSexp(ProcessorState &state, char *tag, int n) { args({string(state, tag), n}); }
+    void processSti(ProcessorState &) {}
+    void processSta(ProcessorState &) {}
+    void processJmp(ProcessorState &, int addr) { reference = addr; args({0}); insn.falls = false; }
+    void processEnd(ProcessorState &) { insn.falls = false; }
+    void processRet(ProcessorState &) {}
+    void processDrop(ProcessorState &) {}
+    void processDup(ProcessorState &) {}
+    void processSwap(ProcessorState &) {}
+    void processElem(ProcessorState &) {}
+
+    void processLd(ProcessorState &, const Loc &loc) { args({loc.value}); }
+    void processLda(ProcessorState &, const Loc &loc) { args({loc.value}); }
+    void processSt(ProcessorState &, const Loc &loc) { args({loc.value}); }
+
+    void processCJmp(ProcessorState &, aint addr, bool) { reference = static_cast<int>(addr); args({0}); }
+    void processBegin(ProcessorState &, int nargs, int nlocals) { args({nargs, nlocals}); }
+
+    void processClosure(ProcessorState &state, int n, int addr) {
+        reference = addr;
+        args({0, n});
+        for (int i = 0; i < n; i++) {
+            char locType = state.readByte();
+            auto loc = state.readLoc(locType);
+            args({static_cast<int>(loc.type), loc.value});
+        }
+    }
+
+    void processCallC(ProcessorState &, int nargs) { args({nargs}); }
+    void processCall(ProcessorState &, size_t addr, int nargs) { reference = static_cast<int>(addr); args({0, nargs}); }
+    void processTag(ProcessorState &state, char *tag, int len) { args({string(state, tag), len}); }
+    void processArray(ProcessorState &, int n) { args({n}); }
+    void processFail(ProcessorState &, int l, int c) { args({l, c}); insn.falls = false; }
+    void processLine(ProcessorState &, int line) { args({line}); }
+    void processPatt(ProcessorState &, int) {}
+
+    void processLread(ProcessorState &) {}
+    void processLwrite(ProcessorState &) {}
+    void processLlength(ProcessorState &) {}
+    void processLstring(ProcessorState &) {}
+    void processBarray(ProcessorState &, int n) { args({n}); }
+};
+
+// The code of a bytecode file reachable from its public symbols, as a list of instructions in the order of the file
+// that passes rewrite and lay out again. Index `insns.size()` stands for the end of the code, which the return from
+// `main` jumps to.
+struct Bytecode {
+    bytefile *bf = nullptr;
+    std::vector<BytecodeInsn> insns;
+    std::vector<std::pair<int, int>> publics; // (name, instruction)
+
+    int end() const {
+        return static_cast<int>(insns.size());
+    }
+
+    // Erases the removed instructions. References to them continue at the first instruction left after them.
+    void compact() {
+        std::vector<int> index(insns.size() + 1);
+        int kept = 0;
+        for (int i = 0; i < end(); i++) {
+            index[i] = insns[i].removed ? -1 : kept++;
+        }
+        index[end()] = kept;
+        for (auto i = end() - 1; i >= 0; i--) {
+            if (insns[i].removed) {
+                index[i] = index[i + 1];
+            }
+        }
+        std::vector<BytecodeInsn> compacted;
+        compacted.reserve(kept);
+        for (auto &insn: insns) {
+            if (!insn.removed) {
+                if (insn.refers()) {
+                    insn.target = index[insn.target];
+                }
+                compacted.push_back(std::move(insn));
+            }
+        }
+        for (auto &[name, at]: publics) {
+            at = index[at];
+        }
+        insns = std::move(compacted);
+    }
+
+    // Lays out the strings the code and the public symbols refer to, each once, and returns the offset of every string
+    // in the new table. If one of them is not terminated in the original table, it is kept as it is, for the engines to
+    // report.
+    std::map<int, int> strings(std::vector<char> &table) const {
+        std::map<int, int> offsets;
+        for (auto &insn: insns) {
+            if (insn.names()) {
+                offsets[insn.args[0]];
+            }
+        }
+        for (auto &[name, at]: publics) {
+            offsets[name];
+        }
+        std::map<std::string, int> laid;
+        for (auto &[offset, at]: offsets) {
+            if (offset < 0 || offset >= bf->stringtab_size ||
+                std::memchr(bf->string_ptr + offset, 0, bf->stringtab_size - offset) == nullptr) {
+                table.assign(bf->string_ptr, bf->string_ptr + bf->stringtab_size);
+                for (auto &[original, kept]: offsets) {
+                    kept = original;
+                }
+                return offsets;
+            }
+            auto *str = bf->string_ptr + offset;
+            auto [it, added] = laid.emplace(str, static_cast<int>(table.size()));
+            if (added) {
+                table.insert(table.end(), str, str + std::strlen(str) + 1);
+            }
+            at = it->second;
+        }
+        return offsets;
+    }
+
+    // Number of bytes the instruction is encoded in, where the capture types of CLOSURE take a byte each
+    static int length(const BytecodeInsn &insn) {
+        auto length = 1 + static_cast<int>(insn.args.size()) * static_cast<int>(sizeof(int));
+        if (insn.opcode == OP_CLOSURE) {
+            length -= static_cast<int>((insn.args.size() - 2) / 2 * (sizeof(int) - 1));
+        }
+        return length;
+    }
+
+    // Returns the offset of every instruction in the laid out code, and the offset of its end, to which the return
+    // from `main` jumps
+    std::vector<int> layout() const {
+        std::vector<int> offsets(insns.size() + 1);
+        int size = 0;
+        for (size_t i = 0; i < insns.size(); i++) {
+            offsets[i] = size;
+            size += length(insns[i]);
+        }
+        // the code ends with a STOP, like the one lamac emits, as reading an instruction needs a byte after it
+        offsets[insns.size()] = size + 1;
+        return offsets;
+    }
+
+    // Maps every offset of the laid out code to the offset it has in the original file, for the diagnostics to report.
+    // Instructions a pass made map to the end of the original code.
+    std::vector<int> origins() const {
+        auto offsets = layout();
+        std::vector<int> origins(offsets.back() + 1, static_cast<int>(bf->code_size));
+        for (size_t i = 0; i < insns.size(); i++) {
+            if (insns[i].offset >= 0) {
+                for (int k = 0; k < length(insns[i]); k++) {
+                    origins[offsets[i] + k] = insns[i].offset + k;
+                }
+            }
+        }
+        return origins;
+    }
+
+    // Lays the code out and returns the contents of a bytecode file with it, the globals and the public symbols of the
+    // original one, and the strings they refer to
+    std::vector<char> encode() const {
+        auto offsets = layout();
+
+        std::vector<char> table;
+        auto strings = this->strings(table);
+
+        std::vector<char> file;
+        auto put = [&](int value) {
+            file.insert(file.end(), reinterpret_cast<char *>(&value), reinterpret_cast<char *>(&value) + sizeof(value));
+        };
+        put(static_cast<int>(table.size()));
+        put(bf->global_area_size);
+        put(static_cast<int>(publics.size()));
+        for (auto &[name, at]: publics) {
+            put(strings[name]);
+            put(offsets[at]);
+        }
+        file.insert(file.end(), table.begin(), table.end());
+        for (auto &insn: insns) {
+            file.push_back(static_cast<char>(insn.opcode));
+            for (size_t j = 0; j < insn.args.size(); j++) {
+                if (j == 0 && insn.refers()) {
+                    put(offsets[insn.target]);
+                } else if (j == 0 && insn.names()) {
+                    put(strings[insn.args[0]]);
+                } else if (insn.opcode == OP_CLOSURE && j >= 2 && j % 2 == 0) {
+                    file.push_back(static_cast<char>(insn.args[j]));
+                } else {
+                    put(insn.args[j]);
+                }
+            }
+        }
+        file.push_back(static_cast<char>(opcodeOf(Instruction::STOP, Instruction::STOP)));
+        return file;
+    }
+};
+
+// Decodes the code reachable from the public symbols, following jumps, calls and closures
+inline Bytecode decodeBytecode(bytefile *bf) {
+    Bytecode code;
+    code.bf = bf;
+
+    std::map<int, std::tuple<BytecodeInsn, int, int>> decoded; // offset -> (instruction, reference, next offset)
+    std::vector<int> worklist;
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        worklist.push_back(get_public_offset(bf, i));
+    }
+    ProcessorState state = {bf, nullptr};
+    while (!worklist.empty()) {
+        auto offset = worklist.back();
+        worklist.pop_back();
+        if (offset == bf->code_size || decoded.contains(offset)) {
+            continue;
+        }
+        if (offset < 0 || offset > bf->code_size) {
+            state.fail("Code reference %.8x is out of bounds for [0, %.8x]", offset, bf->code_size);
+        }
+
+        state.ip = bf->code_ptr + offset;
+        BytecodeDecoder decoder;
+        processInstruction(decoder, state);
+        decoder.insn.opcode = static_cast<unsigned char>(bf->code_ptr[offset]);
+        decoder.insn.offset = offset;
+
+        auto next = static_cast<int>(state.ip - bf->code_ptr);
+        if (decoder.insn.falls) {
+            worklist.push_back(next);
+        }
+        if (decoder.insn.refers()) {
+            worklist.push_back(decoder.reference);
+        }
+        decoded.emplace(offset, std::make_tuple(decoder.insn, decoder.reference, next));
+    }
+
+    std::map<int, int> index; // offset -> instruction
+    int end = 0;
+    for (auto &[offset, entry]: decoded) {
+        if (offset < end) {
+            state.fail("Instruction at %.8x overlaps with the previous one", offset);
+        }
+        end = std::get<2>(entry);
+        index[offset] = static_cast<int>(code.insns.size());
+        code.insns.push_back(std::get<0>(entry));
+    }
+    index[static_cast<int>(bf->code_size)] = code.end();
+
+    auto i = 0;
+    for (auto &[offset, entry]: decoded) {
+        auto &insn = code.insns[i++];
+        if (insn.refers()) {
+            insn.target = index.at(std::get<1>(entry));
+        }
+    }
+    for (int p = 0; p < bf->public_symbols_number; p++) {
+        code.publics.emplace_back(bf->public_ptr[p * 2], index.at(get_public_offset(bf, p)));
+    }
+    return code;
+}
+
+constexpr static long COMPACT_MIN_SAVING = 4096;
+
+// Rebuilds a bytefile at load time with only the code reachable from its public symbols, laid out densely, and only
+// the strings that code refers to, then closes the original one. Diagnostics keep reporting the offsets of the original
+// file. A file that would not shrink by a page is kept, as its mapping is shared with the other processes running it.
+inline bytefile *compactBytefile(bytefile *bf) {
+    auto code = decodeBytecode(bf);
+    auto file = code.encode();
+    if (static_cast<long>(file.size()) + COMPACT_MIN_SAVING > bf->size) {
+        return bf;
+    }
+    auto *compacted = makeBytefile(file.data(), static_cast<long>(file.size()));
+    auto origins = code.origins();
+    compacted->origins = static_cast<int *>(malloc(origins.size() * sizeof(int)));
+    std::memcpy(compacted->origins, origins.data(), origins.size() * sizeof(int));
+    DEBUG("Compacted the code from %ld to %ld bytes\n", bf->code_size, compacted->code_size);
+    closeFile(bf);
+    return compacted;
+}
+
+#endif //VIRTUAL_MACHINES_BYTECODE_H
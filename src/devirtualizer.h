@@ -0,0 +1,194 @@
+#ifndef VIRTUAL_MACHINES_DEVIRTUALIZER_H
+#define VIRTUAL_MACHINES_DEVIRTUALIZER_H
+
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "threaded.h"
+#include "verifier.h"
+
+// Turns closure calls of verified code that can only call one function into direct calls. Every function is
+// interpreted abstractly, with its arguments, locals and operand stack values being either unknown or the closure
+// made by a given CLOSURE instruction of the function. A CALLC or TAIL_CALLC whose closure operand is known on every
+// path becomes a CALL or TAIL_CALL of the target, with `b` set to pass the closure below the arguments, so the
+// callee still finds its captures. A closure without captures that is only ever called this way is never looked
+// at, so its CLOSURE becomes a CONST and nothing is allocated.
+struct Devirtualizer {
+    constexpr static int UNKNOWN = -1;
+
+    ThreadedCode &code;
+    const Verifier &verifier;
+    std::vector<bool> escapes; // by CLOSURE index, whether the closure may be used other than by a known call
+    std::vector<std::vector<int>> in; // values reaching every instruction, only touched by the function owning it
+    std::vector<std::pair<int, int>> sites; // (call, CLOSURE) index pairs of the calls to rewrite
+
+    Devirtualizer(ThreadedCode &code, const Verifier &verifier)
+        : code(code), verifier(verifier), escapes(code.insns.size(), false), in(code.insns.size()) {
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    void escape(int value) {
+        if (value != UNKNOWN) {
+            escapes[value] = true;
+        }
+    }
+
+    // Whether the known closure of the call `insn` can be called directly
+    bool accepts(const Decoded &insn, int closure) const {
+        auto *entry = code.entry(code.insns[closure].jump);
+        return entry != nullptr && entry->op == Op::BEGIN && entry->a == insn.a;
+    }
+
+    // Applies an instruction to the abstract values: arguments, then locals, then the operand stack
+    void step(const Decoded &insn, std::vector<int> &values, int nargs) {
+        auto top = [&]() -> int & { return values.back(); };
+        switch (insn.op) {
+            case Op::CLOSURE:
+                for (int j = 0; j < insn.a; j++) {
+                    auto &loc = insn.locs[j];
+                    if (loc.type == Loc::Type::A || loc.type == Loc::Type::L) {
+                        escape(values[(loc.type == Loc::Type::L ? nargs : 0) + loc.value]);
+                    }
+                }
+                values.push_back(index(&insn));
+                return;
+            case Op::LD_A:
+                values.push_back(values[insn.a]);
+                return;
+            case Op::LD_L:
+                values.push_back(values[nargs + insn.a]);
+                return;
+            case Op::ST_A:
+                values[insn.a] = top();
+                return;
+            case Op::ST_L:
+                values[nargs + insn.a] = top();
+                return;
+            case Op::DUP:
+                values.push_back(top());
+                return;
+            case Op::SWAP:
+                std::swap(values[values.size() - 1], values[values.size() - 2]);
+                return;
+            case Op::DROP:
+                values.pop_back();
+                return;
+            case Op::CALLC:
+            case Op::TAIL_CALLC: {
+                auto closure = values[values.size() - 1 - insn.a];
+                if (closure == UNKNOWN || !accepts(insn, closure)) {
+                    escape(closure);
+                }
+                for (int j = 0; j < insn.a; j++) {
+                    escape(values[values.size() - 1 - j]);
+                }
+                values.resize(values.size() - insn.a - 1);
+                if (insn.op == Op::CALLC) {
+                    values.push_back(UNKNOWN);
+                }
+                return;
+            }
+            default: {
+                auto [pops, pushes] = stackEffect(insn);
+                for (int j = 0; j < pops; j++) {
+                    escape(values.back());
+                    values.pop_back();
+                }
+                values.resize(values.size() + pushes, UNKNOWN);
+                return;
+            }
+        }
+    }
+
+    // Joins the values reaching an instruction into the ones it has seen so far. Returns whether they changed.
+    bool join(std::vector<int> &into, const std::vector<int> &values) {
+        if (into.empty()) {
+            into = values;
+            return true;
+        }
+        auto changed = false;
+        for (size_t j = 0; j < into.size(); j++) {
+            if (into[j] != values[j] && into[j] != UNKNOWN) {
+                escape(into[j]);
+                escape(values[j]);
+                into[j] = UNKNOWN;
+                changed = true;
+            } else if (into[j] == UNKNOWN) {
+                escape(values[j]);
+            }
+        }
+        return changed;
+    }
+
+    void analyze(int entry) {
+        auto &begin = code.insns[entry];
+        auto nargs = begin.a;
+        std::vector<int> worklist = {entry + 1};
+        in[entry + 1].assign(nargs + begin.b, UNKNOWN);
+
+        while (!worklist.empty()) {
+            auto i = worklist.back();
+            worklist.pop_back();
+            auto &insn = code.insns[i];
+            auto values = in[i];
+            step(insn, values, nargs);
+
+            auto flow = [&](const Decoded *next) {
+                if (join(in[index(next)], values)) {
+                    worklist.push_back(index(next));
+                }
+            };
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                flow(insn.target);
+            }
+            if (!isTerminator(insn.op)) {
+                flow(&insn + 1);
+            }
+        }
+    }
+
+    // Returns the number of rewritten calls
+    int run() {
+        for (size_t e = 0; e < code.insns.size(); e++) {
+            if (verifier.owner[e] == static_cast<int>(e) && code.insns[e].op == Op::BEGIN) {
+                analyze(static_cast<int>(e));
+            }
+        }
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            auto &insn = code.insns[i];
+            if ((insn.op != Op::CALLC && insn.op != Op::TAIL_CALLC) || in[i].empty()) {
+                continue;
+            }
+            auto closure = in[i][in[i].size() - 1 - insn.a];
+            if (closure != UNKNOWN && accepts(insn, closure)) {
+                sites.emplace_back(static_cast<int>(i), closure);
+            }
+        }
+        for (auto [site, closure]: sites) {
+            auto &insn = code.insns[site];
+            insn.op = insn.op == Op::CALLC ? Op::CALL : Op::TAIL_CALL;
+            insn.b = 1;
+            insn.jump = code.insns[closure].jump;
+            insn.target = code.entry(insn.jump);
+        }
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            auto &insn = code.insns[i];
+            if (insn.op == Op::CLOSURE && insn.a == 0 && !escapes[i] && verifier.owner[i] >= 0) {
+                insn.op = Op::CONST;
+                insn.a = 0;
+            }
+        }
+        DEBUG("Devirtualized %zu closure calls\n", sites.size());
+        return static_cast<int>(sites.size());
+    }
+};
+
+inline int devirtualize(ThreadedCode &code, const Verifier &verifier) {
+    return Devirtualizer(code, verifier).run();
+}
+
+#endif //VIRTUAL_MACHINES_DEVIRTUALIZER_H
@@ -0,0 +1,164 @@
+#ifndef VIRTUAL_MACHINES_DISPATCH_H
+#define VIRTUAL_MACHINES_DISPATCH_H
+
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+#include "common.h"
+#include "threaded.h"
+
+// Shorter chains are cheaper to run probe by probe than to look up
+constexpr static int DISPATCH_MIN_ARMS = 3;
+constexpr static int DISPATCH_MAX_ARMS = 1024;
+
+// Compiles the chains of probes case-of is made of into SWITCH instructions. The test of a probe is a TAG, an ARRAY
+// or a kind pattern applied to the scrutinee on top of the stack, in one of two shapes:
+// - `DUP; <test>; CJMPZ next`, passing to the instruction after the CJMPZ, which kind patterns compile to;
+// - `DUP; DUP; <test>; CJMPNZ head; DROP; JMP next`, passing to `head` with the scrutinee duplicated, which sexp and
+//   array patterns compile to.
+// The next probe of a chain is the one at `next`. The first DUP of the first probe of a chain becomes a SWITCH, which
+// looks the scrutinee up once and continues where the first probe it passes would have, or at the instruction the
+// chain ends at if it passes none. The probes are left in place, still reachable by their jumps.
+struct DispatchCompiler {
+    struct Probe {
+        const Decoded *test = nullptr;
+        Decoded *pass = nullptr;
+        bool dup = false;
+        Decoded *fail = nullptr;
+    };
+
+    ThreadedCode &code;
+
+    explicit DispatchCompiler(ThreadedCode &code) : code(code) {
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    static bool isTest(const Decoded &test) {
+        switch (test.op) {
+            case Op::TAG:
+                return test.cache != 0; // invalid tags fail in the probe
+            case Op::ARRAY:
+            case Op::PATT_STR_TAG: case Op::PATT_ARRAY: case Op::PATT_SEXP: case Op::PATT_BOXED:
+            case Op::PATT_UNBOXED: case Op::PATT_CLOSURE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool probeAt(size_t i, Probe &probe) {
+        auto n = code.insns.size();
+        auto *insn = &code.insns[i];
+        if (insn[0].op != Op::DUP) {
+            return false;
+        }
+        if (i + 3 < n && isTest(insn[1]) && insn[2].op == Op::CJMPZ) {
+            probe = {&insn[1], &insn[3], false, insn[2].target};
+            return true;
+        }
+        if (i + 5 < n && insn[1].op == Op::DUP && isTest(insn[2]) && insn[3].op == Op::CJMPNZ &&
+            insn[4].op == Op::DROP && insn[5].op == Op::JMP) {
+            probe = {&insn[2], insn[3].target, true, insn[5].target};
+            return true;
+        }
+        return false;
+    }
+
+    // Whether a test passes for a value of the given kind, with sexps and arrays of an arity that is either known or
+    // -1, and sexps with the given tag
+    static bool passes(const Decoded &test, Kind kind, auint tag, int arity) {
+        switch (test.op) {
+            case Op::TAG:
+                return kind == Kind::SEXP && arity >= 0 && arity == test.a &&
+                       tag == static_cast<auint>(UNBOX(test.cache));
+            case Op::ARRAY:
+                return kind == Kind::ARRAY && arity >= 0 && arity == test.a;
+            default:
+                return kindPasses(test.op, kind);
+        }
+    }
+
+    bool compile(int head) {
+        std::vector<int> heads;
+        std::vector<Probe> chain;
+        Probe probe;
+        auto i = head;
+        while (chain.size() < DISPATCH_MAX_ARMS && std::ranges::find(heads, i) == heads.end() && probeAt(i, probe)) {
+            heads.push_back(i);
+            chain.push_back(probe);
+            i = index(probe.fail);
+        }
+        if (chain.size() < DISPATCH_MIN_ARMS) {
+            return false;
+        }
+        auto arm = [&](Kind kind, auint tag, int arity) -> Dispatch::Arm {
+            for (auto &p: chain) {
+                if (passes(*p.test, kind, tag, arity)) {
+                    return {tag, arity, p.pass, p.dup};
+                }
+            }
+            return {tag, arity, &code.insns[i], false};
+        };
+
+        Dispatch cases;
+        for (auto kind: {Kind::GENERIC, Kind::UNBOXED, Kind::STRING, Kind::ARRAY, Kind::SEXP, Kind::CLOSURE}) {
+            cases.kinds[static_cast<int>(kind)] = arm(kind, 0, -1);
+        }
+        auto nsexps = std::ranges::count_if(chain, [](auto &p) { return p.test->op == Op::TAG; });
+        if (nsexps > 0) {
+            cases.sexps.resize(std::bit_ceil(2 * static_cast<size_t>(nsexps)));
+        }
+        auto mask = cases.sexps.size() - 1;
+        for (auto &p: chain) {
+            auto &test = *p.test;
+            if (test.op == Op::TAG) {
+                auto tag = static_cast<auint>(UNBOX(test.cache));
+                auto h = dispatchHash(tag, test.a) & mask;
+                while (cases.sexps[h].target != nullptr &&
+                       (cases.sexps[h].tag != tag || cases.sexps[h].arity != test.a)) {
+                    h = (h + 1) & mask;
+                }
+                if (cases.sexps[h].target == nullptr) {
+                    cases.sexps[h] = arm(Kind::SEXP, tag, test.a);
+                }
+            } else if (test.op == Op::ARRAY && test.a >= 0 &&
+                       std::ranges::none_of(cases.arrays, [&](auto &a) { return a.arity == test.a; })) {
+                cases.arrays.push_back(arm(Kind::ARRAY, 0, test.a));
+            }
+        }
+
+        auto &insn = code.insns[head];
+        insn.op = Op::SWITCH;
+        insn.cases = &code.dispatches.emplace_back(std::move(cases));
+        return true;
+    }
+
+    // Returns the number of compiled chains
+    int run() {
+        std::vector<bool> inner(code.insns.size(), false);
+        Probe probe;
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (probeAt(i, probe)) {
+                inner[index(probe.fail)] = true;
+            }
+        }
+        int chains = 0;
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (!inner[i] && probeAt(i, probe)) {
+                chains += compile(static_cast<int>(i));
+            }
+        }
+        DEBUG("Compiled %d case-of chains\n", chains);
+        return chains;
+    }
+};
+
+inline int compileDispatch(ThreadedCode &code) {
+    return DispatchCompiler(code).run();
+}
+
+#endif //VIRTUAL_MACHINES_DISPATCH_H
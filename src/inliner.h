@@ -0,0 +1,258 @@
+#ifndef VIRTUAL_MACHINES_INLINER_H
+#define VIRTUAL_MACHINES_INLINER_H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "bytecode.h"
+#include "common.h"
+#include "threaded.h"
+#include "verifier.h"
+
+constexpr static int INLINE_MAX_INSNS = 12;
+
+// Splices small functions into the CALL instructions to them, saving the frame a call builds and the return. A function
+// is inlined if it starts with BEGIN, so that it has no captures, its instructions are laid out right after its BEGIN
+// and are at most INLINE_MAX_INSNS, it cannot reach itself in the call graph, and it returns its result as the only
+// value on its operand stack. Its arguments and locals become locals of the caller, shared by all the call sites of the
+// caller: the inlined code stores the arguments into them and clears the locals, as BEGIN would, and its END becomes a
+// jump past it. Callees are spliced as they are in the original code, so calls in an inlined body stay calls.
+// The code must be verified, and `threaded` decoded from the same file, for the stack effects of the instructions.
+struct Inliner {
+    Bytecode &code;
+    const ThreadedCode &threaded;
+    std::vector<int> owner; // BEGIN of the function every instruction belongs to
+    std::vector<int> size; // for every BEGIN, the number of instructions after it to inline, or -1 if it is not inlined
+    std::vector<std::vector<int>> callees; // for every BEGIN, the functions it calls
+
+    Inliner(Bytecode &code, const ThreadedCode &threaded)
+        : code(code), threaded(threaded), owner(code.insns.size(), -1), size(code.insns.size(), -1),
+          callees(code.insns.size()) {
+    }
+
+    static bool isCapture(int type) {
+        return type == static_cast<int>(Loc::Type::C);
+    }
+
+    // The engines elide the instructions without any effect, such as LINE
+    StackEffect effect(const BytecodeInsn &insn) const {
+        auto *decoded = threaded.entry(insn.offset);
+        return decoded != nullptr && decoded->opcode == insn.opcode ? stackEffect(*decoded) : StackEffect{0, 0};
+    }
+
+    // Walks the function starting at `entry`, recording the instructions it owns and whether it can be inlined
+    void analyze(int entry) {
+        auto inlinable = code.insns[entry].opcode == OP_BEGIN;
+        auto last = entry, count = 0;
+        std::vector<std::pair<int, int>> worklist = {{entry + 1, 0}};
+        while (!worklist.empty()) {
+            auto [i, d] = worklist.back();
+            worklist.pop_back();
+            if (i >= code.end() || owner[i] >= 0) {
+                continue;
+            }
+            owner[i] = entry;
+            last = std::max(last, i);
+            count++;
+
+            auto &insn = code.insns[i];
+            switch (insn.hi()) {
+                case Instruction::LD:
+                case Instruction::ST:
+                    inlinable &= !isCapture(static_cast<int>(insn.lo()));
+                    break;
+                case Instruction::LDA:
+                    inlinable = false; // it fails, and is kept where the failure reports it
+                    break;
+                default:
+                    break;
+            }
+            if (insn.opcode == OP_CLOSURE) {
+                for (size_t j = 2; j < insn.args.size(); j += 2) {
+                    inlinable &= !isCapture(insn.args[j]);
+                }
+            } else if (insn.opcode == OP_CALL) {
+                callees[entry].push_back(insn.target);
+            } else if (insn.opcode == OP_END) {
+                inlinable &= d == 1;
+            } else if (insn.hi() == Instruction::CONST_H &&
+                       (insn.lo() == Instruction::STI || insn.lo() == Instruction::RET)) {
+                inlinable = false;
+            }
+
+            auto [pops, pushes] = effect(insn);
+            auto next = d - pops + pushes;
+            if (insn.jumps()) {
+                worklist.emplace_back(insn.target, next);
+            }
+            if (insn.falls) {
+                worklist.emplace_back(i + 1, next);
+            }
+        }
+        if (inlinable && last - entry == count && count <= INLINE_MAX_INSNS) {
+            size[entry] = count;
+        }
+    }
+
+    bool reaches(int from, int to, std::vector<bool> &visited) const {
+        for (auto callee: callees[from]) {
+            if (callee == to) {
+                return true;
+            }
+            if (!visited[callee]) {
+                visited[callee] = true;
+                if (reaches(callee, to, visited)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool isSite(const BytecodeInsn &insn, int i) const {
+        return insn.opcode == OP_CALL && owner[i] >= 0 && size[insn.target] >= 0;
+    }
+
+    // Number of instructions that replace a call of `callee`
+    int expansion(int callee) const {
+        auto &begin = code.insns[callee];
+        return 2 * begin.args[0] + 3 * begin.args[1] + size[callee];
+    }
+
+    // Moves an argument or a local of the callee to the locals of the caller from `base`
+    static void relocate(int &type, int &value, int base, int nargs) {
+        if (type == static_cast<int>(Loc::Type::A)) {
+            type = static_cast<int>(Loc::Type::L);
+            value += base;
+        } else if (type == static_cast<int>(Loc::Type::L)) {
+            value += base + nargs;
+        }
+    }
+
+    static BytecodeInsn make(unsigned char opcode, std::vector<int> args = {}) {
+        BytecodeInsn insn;
+        insn.opcode = opcode;
+        insn.args = std::move(args);
+        return insn;
+    }
+
+    static BytecodeInsn storeLocal(int local) {
+        return make(opcodeOf(Instruction::ST, static_cast<Instruction>(Loc::Type::L)), {local});
+    }
+
+    // Appends the code replacing the call at `site` to `out`, given the new index of every original instruction
+    void expand(int site, int base, const std::vector<int> &index, std::vector<BytecodeInsn> &out) const {
+        auto callee = code.insns[site].target;
+        auto nargs = code.insns[callee].args[0], nlocals = code.insns[callee].args[1];
+        auto body = index[site] + expansion(callee) - size[callee];
+
+        for (auto a = nargs - 1; a >= 0; a--) {
+            out.push_back(storeLocal(base + a));
+            out.push_back(make(OP_DROP));
+        }
+        for (int l = 0; l < nlocals; l++) {
+            out.push_back(make(OP_CONST, {0}));
+            out.push_back(storeLocal(base + nargs + l));
+            out.push_back(make(OP_DROP));
+        }
+        for (auto j = callee + 1; j <= callee + size[callee]; j++) {
+            auto insn = code.insns[j];
+            if (insn.opcode == OP_END) {
+                insn = make(OP_JMP, {0});
+                insn.target = index[site + 1];
+                insn.falls = false;
+            } else if (insn.jumps()) {
+                insn.target = body + insn.target - callee - 1;
+            } else if (insn.refers()) {
+                insn.target = index[insn.target];
+            }
+            if (insn.hi() == Instruction::LD || insn.hi() == Instruction::ST) {
+                auto type = static_cast<int>(insn.lo());
+                relocate(type, insn.args[0], base, nargs);
+                insn.opcode = opcodeOf(insn.hi(), static_cast<Instruction>(type));
+            } else if (insn.opcode == OP_CLOSURE) {
+                for (size_t k = 2; k < insn.args.size(); k += 2) {
+                    relocate(insn.args[k], insn.args[k + 1], base, nargs);
+                }
+            }
+            out.push_back(std::move(insn));
+        }
+    }
+
+    // Returns the number of inlined calls
+    int run() {
+        auto n = code.end();
+        std::vector<int> entries;
+        for (auto &[name, at]: code.publics) {
+            entries.push_back(at);
+        }
+        for (auto &insn: code.insns) {
+            if (insn.opcode == OP_CALL || insn.opcode == OP_CLOSURE) {
+                entries.push_back(insn.target);
+            }
+        }
+        for (auto e: entries) {
+            if (owner[e] < 0) {
+                owner[e] = e;
+                analyze(e);
+            }
+        }
+        for (int e = 0; e < n; e++) {
+            std::vector<bool> visited(n, false);
+            if (size[e] >= 0 && reaches(e, e, visited)) {
+                size[e] = -1;
+            }
+        }
+
+        // the locals every caller gets for the callees it inlines
+        std::vector<int> extra(n, 0);
+        std::vector<int> index(n + 1);
+        int next = 0, calls = 0;
+        for (int i = 0; i < n; i++) {
+            auto &insn = code.insns[i];
+            index[i] = next;
+            if (isSite(insn, i)) {
+                auto &begin = code.insns[insn.target];
+                extra[owner[i]] = std::max(extra[owner[i]], begin.args[0] + begin.args[1]);
+                next += expansion(insn.target);
+                calls++;
+            } else {
+                next++;
+            }
+        }
+        index[n] = next;
+        if (calls == 0) {
+            return 0;
+        }
+
+        std::vector<BytecodeInsn> out;
+        out.reserve(next);
+        for (int i = 0; i < n; i++) {
+            auto &insn = code.insns[i];
+            if (isSite(insn, i)) {
+                expand(i, code.insns[owner[i]].args[1], index, out);
+                continue;
+            }
+            out.push_back(insn);
+            if (insn.refers()) {
+                out.back().target = index[insn.target];
+            }
+            if (owner[i] == i) {
+                out.back().args[1] += extra[i];
+            }
+        }
+        for (auto &[name, at]: code.publics) {
+            at = index[at];
+        }
+        code.insns = std::move(out);
+        DEBUG("Inlined %d calls\n", calls);
+        return calls;
+    }
+};
+
+inline int inlineCalls(Bytecode &code, const ThreadedCode &threaded) {
+    return Inliner(code, threaded).run();
+}
+
+#endif //VIRTUAL_MACHINES_INLINER_H
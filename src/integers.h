@@ -0,0 +1,163 @@
+#ifndef VIRTUAL_MACHINES_INTEGERS_H
+#define VIRTUAL_MACHINES_INTEGERS_H
+
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "threaded.h"
+#include "verifier.h"
+
+// Specializes the binary operators of verified code whose operands are always integers into the _INT operators, which
+// work on the boxed values directly instead of unboxing them and boxing the result. Every function is interpreted
+// abstractly, with its arguments, locals and operand stack values being either known to be integers or not. Constants,
+// the results of operators, tests and patterns, `read` and `.length` are integers, and so are the locals BEGIN
+// initializes; arguments, globals, captures, elements and results of calls are not known to be. Values stay boxed on
+// the stack, as the collector takes any unboxed value there for a pointer.
+struct IntegerSpecializer {
+    ThreadedCode &code;
+    const Verifier &verifier;
+    std::vector<std::vector<char>> in; // whether the values reaching every instruction are integers
+
+    IntegerSpecializer(ThreadedCode &code, const Verifier &verifier)
+        : code(code), verifier(verifier), in(code.insns.size()) {
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    static bool producesInteger(Op op) {
+        switch (op) {
+            case Op::ADD: case Op::SUB: case Op::MUL: case Op::DIV: case Op::MOD: case Op::LT: case Op::LTQ:
+            case Op::GT: case Op::GTQ: case Op::EQ: case Op::NEQ: case Op::AND: case Op::OR:
+            case Op::ADD_INT: case Op::SUB_INT: case Op::MUL_INT: case Op::LT_INT: case Op::LTQ_INT: case Op::GT_INT:
+            case Op::GTQ_INT: case Op::EQ_INT: case Op::NEQ_INT:
+            case Op::TAG: case Op::ARRAY: case Op::PATT_STR: case Op::PATT_STR_TAG: case Op::PATT_ARRAY:
+            case Op::PATT_SEXP: case Op::PATT_BOXED: case Op::PATT_UNBOXED: case Op::PATT_CLOSURE:
+            case Op::LREAD: case Op::LLENGTH:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static Op specialized(Op op) {
+        switch (op) {
+            case Op::ADD: return Op::ADD_INT;
+            case Op::SUB: return Op::SUB_INT;
+            case Op::MUL: return Op::MUL_INT;
+            case Op::LT: return Op::LT_INT;
+            case Op::LTQ: return Op::LTQ_INT;
+            case Op::GT: return Op::GT_INT;
+            case Op::GTQ: return Op::GTQ_INT;
+            case Op::EQ: return Op::EQ_INT;
+            case Op::NEQ: return Op::NEQ_INT;
+            default: return op;
+        }
+    }
+
+    // Applies an instruction to the abstract values: arguments, then locals, then the operand stack
+    void step(const Decoded &insn, std::vector<char> &values, int nargs) {
+        switch (insn.op) {
+            case Op::CONST:
+                values.push_back(true);
+                return;
+            case Op::LD_A:
+                values.push_back(values[insn.a]);
+                return;
+            case Op::LD_L:
+                values.push_back(values[nargs + insn.a]);
+                return;
+            case Op::ST_A:
+                values[insn.a] = values.back();
+                return;
+            case Op::ST_L:
+                values[nargs + insn.a] = values.back();
+                return;
+            case Op::DUP:
+                values.push_back(values.back());
+                return;
+            case Op::SWAP:
+                std::swap(values[values.size() - 1], values[values.size() - 2]);
+                return;
+            default: {
+                auto [pops, pushes] = stackEffect(insn);
+                values.resize(values.size() - pops);
+                values.resize(values.size() + pushes, producesInteger(insn.op));
+                return;
+            }
+        }
+    }
+
+    // Joins the values reaching an instruction into the ones it has seen so far. Returns whether they changed.
+    static bool join(std::vector<char> &into, const std::vector<char> &values) {
+        if (into.empty()) {
+            into = values;
+            return true;
+        }
+        auto changed = false;
+        for (size_t j = 0; j < into.size(); j++) {
+            if (into[j] && !values[j]) {
+                into[j] = false;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    void analyze(int entry) {
+        auto &begin = code.insns[entry];
+        auto nargs = begin.a;
+        std::vector<int> worklist = {entry + 1};
+        in[entry + 1].assign(nargs, false);
+        in[entry + 1].resize(nargs + begin.b, true);
+
+        while (!worklist.empty()) {
+            auto i = worklist.back();
+            worklist.pop_back();
+            auto &insn = code.insns[i];
+            auto values = in[i];
+            step(insn, values, nargs);
+
+            auto flow = [&](const Decoded *next) {
+                if (join(in[index(next)], values)) {
+                    worklist.push_back(index(next));
+                }
+            };
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                flow(insn.target);
+            }
+            if (!isTerminator(insn.op)) {
+                flow(&insn + 1);
+            }
+        }
+    }
+
+    // Returns the number of specialized operators
+    int run() {
+        for (size_t e = 0; e < code.insns.size(); e++) {
+            if (verifier.owner[e] == static_cast<int>(e) && code.insns[e].op == Op::BEGIN) {
+                analyze(static_cast<int>(e));
+            }
+        }
+        int operators = 0;
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            auto &insn = code.insns[i];
+            auto op = specialized(insn.op);
+            auto &values = in[i];
+            if (op != insn.op && values.size() >= 2 && values[values.size() - 1] && values[values.size() - 2]) {
+                insn.op = op;
+                operators++;
+            }
+        }
+        DEBUG("Specialized %d integer operators\n", operators);
+        return operators;
+    }
+};
+
+inline int specializeIntegers(ThreadedCode &code, const Verifier &verifier) {
+    return IntegerSpecializer(code, verifier).run();
+}
+
+#endif //VIRTUAL_MACHINES_INTEGERS_H
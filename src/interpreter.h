@@ -0,0 +1,528 @@
+#ifndef VIRTUAL_MACHINES_INTERPRETER_H
+#define VIRTUAL_MACHINES_INTERPRETER_H
+
+#include <cstring>
+#include <string>
+
+#include "common.h"
+#include "primitives.h"
+#include "processor.h"
+#include "../bytecode/bytefile.h"
+#include "../runtime/gc.h"
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+
+constexpr static int VSTACK_SIZE = 1 << 20;
+
+// A call pushes a frame record of this many words on the value stack, after the arguments: the return address, the
+// frame pointer of the caller and the packed sizes of its frame. The frame pointer of the callee points to the record,
+// with the locals and the operand stack following it.
+constexpr static int FRAME_WORDS = 3;
+
+inline aint vstack[VSTACK_SIZE]{};
+
+#define BINOP(op)                       \
+    {                                   \
+        auto rhs = UNBOX(vstack_pop()); \
+        auto lhs = UNBOX(vstack_pop()); \
+        auto v = lhs op rhs;            \
+        vstack_push(BOX(v));            \
+        break;                          \
+    }
+
+#define BINOP_DIV(op)                                                                           \
+    {                                                                                           \
+        auto rhs = UNBOX(vstack_pop());                                                         \
+        auto lhs = UNBOX(vstack_pop());                                                         \
+        if (rhs == 0) {                                                                         \
+            state.fail("Attempt to divide %d by zero when executing operation %s", lhs, #op);   \
+        }                                                                                       \
+        auto v = lhs op rhs;                                                                    \
+        vstack_push(BOX(v));                                                                    \
+        break;                                                                                  \
+    }
+
+// With `Checked` disabled, every check that the bytecode verifier proves statically (stack underflow, frame and
+// location bounds, closure accesses) is compiled out, and stack overflow is only checked once per frame, in BEGIN.
+// The semantic failures are always checked.
+template<bool Checked = true>
+struct Interpreter {
+    ProcessorState& state;
+
+    // Frame of the running function, saved into the frame record of every call it makes
+    aint *fp = nullptr;
+    int frame_nargs = 0;
+    int frame_nlocals = 0;
+    bool frame_closure = false;
+
+    explicit Interpreter(ProcessorState &state) : state(state) {
+    }
+
+#define SP (__gc_stack_top + 1)
+
+    inline void verify_vstack(aint *location, const std::string &trace) {
+        if constexpr (!Checked) {
+            return;
+        }
+        if (location >= __gc_stack_bottom) {
+            state.fail("Virtual stack underflow! .loc: %.8x, .bot: %.8x, trace: %s", location, __gc_stack_bottom,
+                       trace.c_str());
+        }
+        if (location <= vstack) {
+            state.fail("Virtual stack overflow! .loc: %.8x, .top: %.8x, trace: %s", location, vstack, trace.c_str());
+        }
+    }
+
+    inline aint vstack_pop() const {
+        if (Checked && SP >= __gc_stack_bottom) {
+            state.fail("Virtual stack underflow!");
+        }
+        __gc_stack_top += 1;
+        return *(SP - 1);
+    }
+
+    inline void vstack_push(aint val) const {
+        if (Checked && vstack >= __gc_stack_top) {
+            state.fail("Virtual stack overflow!");
+        }
+        __gc_stack_top -= 1;
+        *SP = val;
+    }
+
+    inline void init_vstack(const bytefile *bf) {
+        DEBUG("Init vstack %s\n", "")
+        // values live in [SP, __gc_stack_bottom), and the GC fixes up one more word after the bottom when compacting
+        __gc_stack_bottom = vstack + VSTACK_SIZE - 1;
+        __gc_stack_top = __gc_stack_bottom - 1;
+
+        DEBUG("Allocate %d globals\n", bf->global_area_size)
+        for (auto i = 0; i < bf->global_area_size; i++) {
+            vstack_push(bf->global_ptr[bf->global_area_size - i - 1]);
+        }
+        vstack_push(0);
+        vstack_push(0); // argc argv
+    }
+
+    inline void verify_frame(const char *msg) const {
+        if (Checked && fp == nullptr) {
+            state.fail(msg);
+        }
+    }
+
+    // Pushes the frame record of a call, to be completed by the BEGIN of the callee
+    inline void call(aint ret, bool closure) {
+        vstack_push(ret);
+        vstack_push(reinterpret_cast<aint>(fp));
+        vstack_push(static_cast<aint>(frame_nlocals) << 32 | static_cast<aint>(frame_nargs) << 2 |
+                    static_cast<aint>(frame_closure) << 1 | 1);
+        frame_closure = closure;
+    }
+
+    // Replaces the current frame with the frame record of a call of the `nargs` values on top of the stack and of the
+    // closure below them, if there is one. The call returns where the current function would have.
+    inline void tailCall(int nargs, bool closure) {
+        verify_frame("Call stack underflow!");
+        auto n = nargs + static_cast<int>(closure);
+        verify_vstack(SP + n - 1, ".tailcall");
+        auto *record = fp;
+        auto ret = record[2], caller = record[1], meta = record[0];
+        auto *base = record + FRAME_WORDS + frame_nargs + static_cast<int>(frame_closure);
+        std::memmove(base - n, SP, n * sizeof(aint));
+        __gc_stack_top = base - n - 1;
+        vstack_push(ret);
+        vstack_push(caller);
+        vstack_push(meta);
+        frame_closure = closure;
+    }
+
+    inline bool is_closure() const {
+        return frame_closure;
+    }
+
+    inline aint ret_addr() const {
+        verify_frame("Invalid call stack: expected return address");
+        return fp[2];
+    }
+
+    inline aint *frame_pointer() const {
+        verify_frame("Invalid call stack: expected frame pointer");
+        return fp;
+    }
+
+    inline aint nargs() const {
+        return frame_nargs;
+    }
+
+    inline aint nlocals() const {
+        return frame_nlocals;
+    }
+
+    inline aint *global(const bytefile *bf, int ind) {
+        if (Checked && (ind < 0 || ind >= bf->global_area_size)) {
+            state.fail("Requested global %d is out of bounds for [0, %d)", ind, bf->global_area_size);
+        }
+
+        auto loc = __gc_stack_bottom - bf->global_area_size + ind;
+        verify_vstack(loc, ".global");
+        return loc;
+    }
+
+    inline aint *arg(int ind) {
+        if (Checked && (ind < 0 || ind >= nargs())) {
+            state.fail("Requested argument %d is out of bounds for [0, %d)", ind, nargs());
+        }
+
+        auto loc = frame_pointer() + FRAME_WORDS + nargs() - 1 - ind;
+        verify_vstack(loc, ".arg");
+        return loc;
+    }
+
+    inline aint *local(int ind) {
+        auto nlcls = nlocals();
+        if (Checked && (ind < 0 || ind >= nlocals())) {
+            state.fail("Requested local %d is out of bounds for [0, %d)", ind, nlocals());
+        }
+
+        auto loc = frame_pointer() - nlcls + ind;
+        verify_vstack(loc, ".local");
+        return loc;
+    }
+
+    inline aint *closure_loc() {
+        if (Checked && !is_closure()) {
+            state.fail("Requested closure, but closure is not placed on stack");
+        }
+
+        auto loc = frame_pointer() + FRAME_WORDS + nargs();
+        verify_vstack(loc, ".closure");
+        return loc;
+    }
+
+    inline aint *closure(int ind) {
+        auto closureLoc = closure_loc();
+        auto closureData = TO_DATA(*closureLoc);
+
+        if (Checked && TAG(closureData->data_header) != CLOSURE_TAG) {
+            state.fail("Requested closure element %d, but the value on stack is not a closure", ind);
+        }
+
+        return &((aint *) closureData->contents)[ind + 1];
+    }
+
+    inline void processBinop(ProcessorState& _, const BinOp &op) const {
+        switch (op) {
+            case BinOp::PLUS: BINOP(+)
+            case BinOp::MINUS: BINOP(-)
+            case BinOp::TIMES: BINOP(*)
+            case BinOp::DIV: BINOP_DIV(/)
+            case BinOp::MOD: BINOP_DIV(%)
+            case BinOp::LT: BINOP(<)
+            case BinOp::LTQ: BINOP(<=)
+            case BinOp::GT: BINOP(>)
+            case BinOp::GTQ: BINOP(>=)
+            case BinOp::EQ: BINOP(==)
+            case BinOp::NEQ: BINOP(!=)
+            case BinOp::AND: BINOP(&&)
+            case BinOp::OR: BINOP(||)
+        }
+    }
+
+    inline void processConst(ProcessorState& _, int cnst) const {
+        vstack_push(BOX(cnst));
+    }
+
+    inline void processJmp(ProcessorState& _, int addr) const {
+        state.ip = state.bf->code_ptr + addr;
+    }
+
+    inline void processString(ProcessorState& _, char *string) const {
+        vstack_push((aint) Bstring((aint *) &string));
+    }
+
+    // `hash` is the boxed hash of the tag when it was interned at load time, or 0 to compute it here
+    inline void processSexp(ProcessorState& _, char *tag, int nargs, aint hash = 0) {
+        if (Checked && nargs < 0) {
+            state.fail("Invalid SEXP op: negative length %d", nargs);
+        }
+
+        verify_vstack(SP + nargs, ".sexp");
+        vstack_push(hash != 0 ? hash : LtagHash(tag));
+
+        auto result = fastSexp(SP, nargs);
+
+        __gc_stack_top += nargs + 1;
+        vstack_push(result);
+    }
+
+    inline void processSti(ProcessorState& _) const {
+        state.fail("Unsupported instruction STI");
+    }
+
+    inline void processSta(ProcessorState& _) const {
+        auto val = vstack_pop();
+        auto ind = vstack_pop();
+        auto dst = vstack_pop();
+
+        vstack_push(fastSta(dst, ind, val));
+    }
+
+    inline void processSt(ProcessorState& _, const Loc &loc) {
+        auto value = vstack_pop();
+        switch (loc.type) {
+            case Loc::Type::G: {
+                *global(state.bf, loc.value) = value;
+                break;
+            }
+            case Loc::Type::L: {
+                *local(loc.value) = value;
+                break;
+            }
+            case Loc::Type::A: {
+                *arg(loc.value) = value;
+                break;
+            }
+            case Loc::Type::C: {
+                *closure(loc.value) = value;
+                break;
+            }
+        }
+        vstack_push(value);
+    }
+
+    inline void processDrop(ProcessorState& _) const {
+        vstack_pop();
+    }
+
+    inline void processDup(ProcessorState& _) const {
+        auto val = vstack_pop();
+        vstack_push(val);
+        vstack_push(val);
+    }
+
+    inline void processSwap(ProcessorState& _) const {
+        auto x = vstack_pop();
+        auto y = vstack_pop();
+
+        vstack_push(x);
+        vstack_push(y);
+    }
+
+    inline void processElem(ProcessorState& _) const {
+        auto ind = vstack_pop();
+        auto src = vstack_pop();
+
+        vstack_push(fastElem(src, ind));
+    }
+
+    inline aint load(ProcessorState& _, const Loc &loc) {
+        aint value{};
+        switch (loc.type) {
+            case Loc::Type::G: {
+                value = *global(state.bf, loc.value);
+                break;
+            }
+            case Loc::Type::L: {
+                value = *local(loc.value);
+                break;
+            }
+            case Loc::Type::A: {
+                value = *arg(loc.value);
+                break;
+            }
+            case Loc::Type::C: {
+                value = *closure(loc.value);
+                break;
+            }
+        }
+        return value;
+    }
+
+    inline void processLd(ProcessorState& _,  const Loc &loc) {
+        vstack_push(load(state, loc));
+    }
+
+    inline void processLda(ProcessorState& _,  const Loc &) const {
+        state.fail("LDA is not supported");
+    }
+
+    inline void processEnd(ProcessorState& _) {
+        state.update_ip(leave());
+    }
+
+    // Tears down the current frame and returns the return address stored in it
+    inline aint leave() {
+        verify_frame("Call stack underflow!");
+        aint retval = 0;
+        bool isRetval = false;
+        if (SP < fp - frame_nlocals) {
+            retval = vstack_pop();
+            isRetval = true;
+        }
+
+        auto *record = fp;
+        auto loc = record + FRAME_WORDS + frame_nargs + static_cast<int>(frame_closure) - 1;
+        verify_vstack(loc - 1, ".end"); // it's ok to have an empty vstack after end
+
+        auto meta = record[0];
+        fp = reinterpret_cast<aint *>(record[1]);
+        frame_nlocals = static_cast<int>(meta >> 32);
+        frame_nargs = static_cast<int>((meta & 0xFFFFFFFF) >> 2);
+        frame_closure = (meta & 2) != 0;
+
+        __gc_stack_top = loc;
+        if (isRetval) {
+            vstack_push(retval);
+        }
+        return record[2];
+    }
+
+    inline void processRet(ProcessorState& _) const {
+        state.fail("RET is not supported");
+    }
+
+    inline void processCJmp(ProcessorState& _, aint addr, bool isNz) const {
+        if (auto val = UNBOX(vstack_pop()); isNz != !val) {
+            state.update_ip(addr);
+        }
+    }
+
+    // With the maximum operand stack depth of the function known, the whole frame is checked to fit at once, along
+    // with the frame record of the next call, and unchecked pushes skip their own checks
+    inline void processBegin(ProcessorState& _, int n_args, int n_locals, int depth = -1) {
+        if (depth >= 0 && SP - n_locals - depth - FRAME_WORDS <= vstack) {
+            state.fail("Virtual stack overflow!");
+        }
+        fp = SP;
+        frame_nargs = n_args;
+        frame_nlocals = n_locals;
+        for (int i = 0; i < n_locals; i++) {
+            vstack_push(BOX(0));
+        }
+    }
+
+    inline void processTag(ProcessorState& _, char *tag, int len, aint hash = 0) const {
+        auto dest = vstack_pop();
+        vstack_push(fastTag(dest, hash != 0 ? hash : LtagHash(tag), BOX(len)));
+    }
+
+    inline void processArray(ProcessorState& _, int n) const {
+        auto dest = vstack_pop();
+        vstack_push(fastArrayPatt(dest, BOX(n)));
+    }
+
+    inline void processFail(ProcessorState& _, int l, int c) const {
+        state.fail("Failed at %d %d", l, c);
+    }
+
+    static inline void processLine(ProcessorState& _, int) {
+    }
+
+    inline void processPatt(ProcessorState& _, int patt) const {
+        auto x = (void *) vstack_pop();
+        switch (static_cast<Patts>(patt)) {
+            case Patts::STR: {
+                auto y = (void *) vstack_pop();
+                vstack_push(Bstring_patt(x, y));
+                break;
+            }
+            case Patts::STR_TAG: {
+                vstack_push(fastTagPatt((aint) x, STRING_TAG));
+                break;
+            }
+            case Patts::ARRAY: {
+                vstack_push(fastTagPatt((aint) x, ARRAY_TAG));
+                break;
+            }
+            case Patts::SEXP: {
+                vstack_push(fastTagPatt((aint) x, SEXP_TAG));
+                break;
+            }
+            case Patts::BOXED: {
+                vstack_push(fastBoxedPatt((aint) x));
+                break;
+            }
+            case Patts::UNBOXED: {
+                vstack_push(fastUnboxedPatt((aint) x));
+                break;
+            }
+            case Patts::CLOSURE: {
+                vstack_push(fastTagPatt((aint) x, CLOSURE_TAG));
+                break;
+            }
+            default:
+                state.fail("Unexpected pattern %s", patt);
+        }
+    }
+
+    inline void processLread(ProcessorState& _) const {
+        vstack_push(Lread());
+    }
+
+    inline void processLwrite(ProcessorState& _) const {
+        auto x = vstack_pop();
+        vstack_push(Lwrite(x));
+    }
+
+    inline void processLlength(ProcessorState& _) const {
+        auto x = vstack_pop();
+        vstack_push(fastLength(x));
+    }
+
+    inline void processLstring(ProcessorState& _) const {
+        vstack_push((aint) Lstring(SP));
+    }
+
+    inline void processBarray(ProcessorState& _, int n) {
+        verify_vstack(SP + n, ".barray");
+        auto arrayPtr = fastArray(SP, n);
+        __gc_stack_top += n;
+        vstack_push(arrayPtr);
+    }
+
+    inline void processClosure(ProcessorState& _, int nargs, int addr) {
+        for (int i = 0; i < nargs; i++) {
+            char locType = state.readByte();
+            auto loc = state.readLoc(locType);
+            vstack_push(load(state, loc));
+        }
+        pushClosure(nargs, addr);
+    }
+
+    // Builds a closure of the `nargs` captured values on top of the stack
+    inline void pushClosure(int nargs, int addr) {
+        vstack_push(addr);
+        auto closurePtr = fastClosure(SP, nargs);
+        __gc_stack_top += nargs + 1;
+        vstack_push(closurePtr);
+    }
+
+    inline void processCall(ProcessorState& _, size_t addr, int nargs) {
+        verify_vstack(SP + nargs, ".call");
+
+        call(state.ip - state.bf->code_ptr, false);
+
+        state.update_ip((aint) addr);
+    }
+
+    inline void processCallC(ProcessorState& _, int nargs) {
+        /*  stack frame is not yet complete:
+         *  bottom
+         *  ...
+         *  *closure -> target, capture[0], capture[1], ...
+         *  arg[n]
+         *  ...
+         *  arg[0] = sp
+         */
+        verify_vstack(SP + nargs, ".callC");
+
+        auto closureLoc = SP + nargs;
+        verify_vstack(closureLoc, ".callC");
+
+        auto target = ((aint *) *closureLoc)[0];
+        call(state.ip - state.bf->code_ptr, true);
+
+        state.update_ip(target);
+    }
+};
+
+#endif //VIRTUAL_MACHINES_INTERPRETER_H
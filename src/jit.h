@@ -0,0 +1,581 @@
+#ifndef VIRTUAL_MACHINES_JIT_H
+#define VIRTUAL_MACHINES_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define LAMA_JIT_SUPPORTED 1
+#else
+#define LAMA_JIT_SUPPORTED 0
+#endif
+
+#include "common.h"
+#include "interpreter.h"
+#include "threaded.h"
+
+// Larger functions are left to the interpreter, to bound the size of the generated code
+constexpr static int JIT_MAX_FUNCTION_SIZE = 1 << 16;
+
+template<bool Checked>
+struct JitContext {
+    static inline Interpreter<Checked> *interp = nullptr;
+    static inline ThreadedCode *code = nullptr;
+};
+
+// Entry points the generated code calls into. They keep the failure reports of the interpreter accurate and share
+// its semantics, so that the runtime and the GC see the same state as when interpreting.
+
+template<bool Checked>
+inline Interpreter<Checked> &jitSync(const Decoded *pc) {
+    auto &interp = *JitContext<Checked>::interp;
+    interp.state.ip = pc->ip;
+    interp.state.opcode = pc->opcode;
+    return interp;
+}
+
+template<Op op, bool Checked>
+void jitStep(Decoded *pc) {
+    auto &interp = jitSync<Checked>(pc);
+    perform<op>(interp, interp.state, interp.state.bf, pc);
+}
+
+using JitStep = void (*)(Decoded *);
+
+template<bool Checked>
+inline JitStep jitStepOf(Op op) {
+    static const JitStep steps[] = {
+#define JIT_STEP(name) &jitStep<Op::name, Checked>,
+        STRAIGHT_OPS(JIT_STEP)
+#undef JIT_STEP
+    };
+    return steps[static_cast<int>(op)];
+}
+
+template<bool Checked>
+aint jitCondition(Decoded *pc) {
+    return UNBOX(jitSync<Checked>(pc).vstack_pop());
+}
+
+template<bool Checked>
+void jitCall(Decoded *pc) {
+    auto &interp = jitSync<Checked>(pc);
+    interp.verify_vstack(SP + pc->a, ".call");
+    interp.call(reinterpret_cast<aint>(pc + 1), pc->b != 0);
+}
+
+template<bool Checked>
+Decoded *jitCallC(Decoded *pc) {
+    return enterClosure(*JitContext<Checked>::code, jitSync<Checked>(pc), pc);
+}
+
+template<bool Checked>
+void jitTailCall(Decoded *pc) {
+    jitSync<Checked>(pc).tailCall(pc->a, pc->b != 0);
+}
+
+template<bool Checked>
+Decoded *jitTailCallC(Decoded *pc) {
+    return tailClosure(*JitContext<Checked>::code, jitSync<Checked>(pc), pc);
+}
+
+template<bool Checked>
+Decoded *jitSwitch(Decoded *pc) {
+    return selectCase(jitSync<Checked>(pc), pc);
+}
+
+template<bool Checked>
+Decoded *jitUnpack(Decoded *pc) {
+    return unpack(jitSync<Checked>(pc), pc);
+}
+
+template<bool Checked>
+Decoded *jitEnd(Decoded *pc) {
+    return reinterpret_cast<Decoded *>(jitSync<Checked>(pc).leave());
+}
+
+// Baseline compiler for x86-64. Every decoded instruction of a verified function is translated into a copy of a
+// machine code template, with holes patched with its operands, frame offsets, the addresses of the entry points above
+// and the native offsets of jump targets. The native code keeps SP in r12 and the frame pointer in r13, and
+// `&__gc_stack_top` in rbx:
+// - in unchecked code, constants, DUP, DROP, SWAP, loads and stores of globals, arguments and locals, and the binary
+//   operators that can not fail are done inline, on the operand stack through r12 and on the frame at fixed offsets
+//   from r13; a comparison followed by a conditional jump becomes a native compare and branch;
+// - jumps and conditional jumps become native jumps, CALL of a compiled function jumps to its native code after
+//   pushing the frame, and END, CALLC, SWITCH and UNPACK continue at the native code of the instruction they return
+//   to, call or select;
+// - everything else, which allocates, may fail or builds frames, calls its `jitStep` or entry point, with SP written
+//   back to `__gc_stack_top` before and reloaded after it, as is the frame pointer after BEGIN and END.
+// Native code shares the call stack layout of the interpreter and never nests: the native stack only holds the frame
+// of `ThreadedCode::enter`, which is left whenever control reaches an instruction that is not compiled. Functions
+// the JIT does not compile keep being interpreted, and nothing is compiled if the code was not verified.
+struct Jit {
+    std::vector<unsigned char> buffer;
+    std::vector<std::pair<void *, size_t>> regions; // executable memory holding the installed code
+    aint *const *fp = nullptr; // frame pointer of the interpreter, reloaded into r13
+
+    Jit() = default;
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    ~Jit() {
+#if LAMA_JIT_SUPPORTED
+        for (auto &[memory, size]: regions) {
+            munmap(memory, size);
+        }
+#endif
+    }
+
+    // Moves the code emitted so far to executable memory, returning its address or nullptr on failure
+    void *install() {
+#if LAMA_JIT_SUPPORTED
+        auto size = buffer.size();
+        auto *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        std::memcpy(memory, buffer.data(), size);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            return nullptr;
+        }
+        regions.emplace_back(memory, size);
+        buffer.clear();
+        return memory;
+#else
+        return nullptr;
+#endif
+    }
+
+    // Entry of the native code, `ThreadedCode::enter`, given the frame pointer of the interpreter:
+    // push rbx; push r12; push r13; mov rbx, &__gc_stack_top; <reload>; jmp rdi
+    void trampoline(aint *const *framePointer) {
+        fp = framePointer;
+        bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0xBB});
+        imm64(&__gc_stack_top);
+        reload(true);
+        bytes({0xFF, 0xE7});
+    }
+
+    void bytes(std::initializer_list<unsigned char> bs) {
+        buffer.insert(buffer.end(), bs);
+    }
+
+    void imm32(int32_t value) {
+        auto at = buffer.size();
+        buffer.resize(at + sizeof(value));
+        std::memcpy(&buffer[at], &value, sizeof(value));
+    }
+
+    void imm64(const void *value) {
+        auto at = buffer.size();
+        buffer.resize(at + sizeof(value));
+        std::memcpy(&buffer[at], &value, sizeof(value));
+    }
+
+    void patch32(size_t at, int32_t value) {
+        std::memcpy(&buffer[at], &value, sizeof(value));
+    }
+
+    // Writes SP back to the interpreter: lea rax, [r12 - 8]; mov [rbx], rax
+    void sync() {
+        bytes({0x49, 0x8D, 0x44, 0x24, 0xF8, 0x48, 0x89, 0x03});
+    }
+
+    // Reads SP, and the frame pointer if it may have changed, from the interpreter:
+    // mov r12, [rbx]; add r12, 8; [mov rcx, fp; mov r13, [rcx]]
+    void reload(bool frame) {
+        bytes({0x4C, 0x8B, 0x23, 0x49, 0x83, 0xC4, 0x08});
+        if (frame) {
+            bytes({0x48, 0xB9});
+            imm64(fp);
+            bytes({0x4C, 0x8B, 0x29});
+        }
+    }
+
+    // <sync>; mov rdi, pc; mov rax, fn; call rax; <reload>
+    void call(const void *fn, const Decoded *pc, bool frame = false) {
+        sync();
+        bytes({0x48, 0xBF});
+        imm64(pc);
+        bytes({0x48, 0xB8});
+        imm64(fn);
+        bytes({0xFF, 0xD0});
+        reload(frame);
+    }
+
+    // pop r13; pop r12; pop rbx; ret
+    void epilogue() {
+        bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+    }
+
+    // <sync>; mov rax, pc; <epilogue>
+    void leave(const Decoded *pc) {
+        sync();
+        bytes({0x48, 0xB8});
+        imm64(pc);
+        epilogue();
+    }
+
+    // Continues at the native code of the instruction in rax, or leaves to the interpreter if it has none, right
+    // after a call: mov rcx, [rax + native]; test rcx, rcx; je +2; jmp rcx; <epilogue>
+    void resume() {
+        bytes({0x48, 0x8B, 0x88});
+        imm32(static_cast<int32_t>(offsetof(Decoded, native)));
+        bytes({0x48, 0x85, 0xC9, 0x74, 0x02, 0xFF, 0xE1});
+        epilogue();
+    }
+
+    // Emits a rel32 jump with the given opcode bytes, whose target is patched once all code is laid out
+    void jump(std::initializer_list<unsigned char> opcode, int target, std::vector<std::pair<size_t, int>> &jumps) {
+        bytes(opcode);
+        jumps.emplace_back(buffer.size(), target);
+        imm32(0);
+    }
+
+    // Moves between rax (or rcx) and the operand stack slot `slot`, 0 being the top:
+    // mov rax|rcx, [r12 + 8 * slot] or mov [r12 + 8 * slot], rax|rcx
+    void slot(bool load, int slot, bool rcx = false) {
+        bytes({0x49, static_cast<unsigned char>(load ? 0x8B : 0x89), static_cast<unsigned char>(rcx ? 0x4C : 0x44),
+               0x24, static_cast<unsigned char>(8 * slot)});
+    }
+
+    // Pops `n` values off the operand stack, or pushes room for -n, without touching the flags: lea r12, [r12 + 8 * n]
+    void pop(int n) {
+        bytes({0x4D, 0x8D, 0x64, 0x24, static_cast<unsigned char>(8 * n)});
+    }
+
+    // Pushes rax: mov [r12 - 8], rax; lea r12, [r12 - 8]
+    void push() {
+        slot(false, -1);
+        pop(-1);
+    }
+
+    // Moves between rax and the frame word at `offset` words from the frame pointer: mov rax, [r13 + 8 * offset] or
+    // mov [r13 + 8 * offset], rax
+    void frame(bool load, int offset) {
+        bytes({0x49, static_cast<unsigned char>(load ? 0x8B : 0x89), 0x85});
+        imm32(8 * offset);
+    }
+
+    // Moves between rax and a global: mov rax, [moffs64] or mov [moffs64], rax
+    void global(bool load, const aint *address) {
+        bytes({0x48, static_cast<unsigned char>(load ? 0xA1 : 0xA3)});
+        imm64(address);
+    }
+
+    // Condition code of a comparison, whose setcc and jcc opcodes are 0x90 and 0x80 plus it, and whose negation is
+    // the same with the lowest bit flipped; -1 for the other operations
+    static int conditionCode(Op op) {
+        switch (op) {
+            case Op::LT: case Op::LT_INT: return 0xC;
+            case Op::LTQ: case Op::LTQ_INT: return 0xE;
+            case Op::GT: case Op::GT_INT: return 0xF;
+            case Op::GTQ: case Op::GTQ_INT: return 0xD;
+            case Op::EQ: case Op::EQ_INT: return 0x4;
+            case Op::NEQ: case Op::NEQ_INT: return 0x5;
+            default: return -1;
+        }
+    }
+
+    static bool isIntBinop(Op op) {
+        return op >= Op::ADD_INT && op <= Op::NEQ_INT;
+    }
+
+    // Loads the operands of a binary operator into rax and rcx, unboxed unless the operator works on boxed integers:
+    // mov rax, [r12 + 8]; mov rcx, [r12]; [sar rax, 1; sar rcx, 1]
+    void operands(Op op) {
+        slot(true, 1);
+        slot(true, 0, true);
+        if (!isIntBinop(op)) {
+            bytes({0x48, 0xD1, 0xF8, 0x48, 0xD1, 0xF9});
+        }
+    }
+
+    // Performs a binary operator that can not fail on the top two values of the operand stack. Returns false for
+    // the other operators.
+    bool binop(Op op) {
+        auto cc = conditionCode(op);
+        switch (op) {
+            case Op::ADD: case Op::SUB: case Op::MUL: case Op::AND: case Op::OR:
+            case Op::ADD_INT: case Op::SUB_INT: case Op::MUL_INT:
+                break;
+            default:
+                if (cc < 0) {
+                    return false;
+                }
+                break;
+        }
+        operands(op);
+        switch (op) {
+            case Op::ADD:
+            case Op::ADD_INT:
+                bytes({0x48, 0x01, 0xC8}); // add rax, rcx
+                break;
+            case Op::SUB:
+            case Op::SUB_INT:
+                bytes({0x48, 0x29, 0xC8}); // sub rax, rcx
+                break;
+            case Op::MUL:
+                bytes({0x48, 0x0F, 0xAF, 0xC1}); // imul rax, rcx
+                break;
+            case Op::MUL_INT:
+                bytes({0x48, 0xFF, 0xC8, 0x48, 0xD1, 0xF9, 0x48, 0x0F, 0xAF, 0xC1}); // dec rax; sar rcx, 1; imul rax, rcx
+                break;
+            case Op::AND:
+                // test rax, rax; setne al; test rcx, rcx; setne cl; and al, cl; movzx eax, al
+                bytes({0x48, 0x85, 0xC0, 0x0F, 0x95, 0xC0, 0x48, 0x85, 0xC9, 0x0F, 0x95, 0xC1, 0x20, 0xC8,
+                       0x0F, 0xB6, 0xC0});
+                break;
+            case Op::OR:
+                bytes({0x48, 0x09, 0xC8, 0x0F, 0x95, 0xC0, 0x0F, 0xB6, 0xC0}); // or rax, rcx; setne al; movzx eax, al
+                break;
+            default:
+                // cmp rax, rcx; setcc al; movzx eax, al
+                bytes({0x48, 0x39, 0xC8, 0x0F, static_cast<unsigned char>(0x90 + cc), 0xC0, 0x0F, 0xB6, 0xC0});
+                break;
+        }
+        switch (op) {
+            case Op::ADD_INT:
+                bytes({0x48, 0xFF, 0xC8}); // dec rax
+                break;
+            case Op::SUB_INT:
+            case Op::MUL_INT:
+                bytes({0x48, 0xFF, 0xC0}); // inc rax
+                break;
+            default:
+                bytes({0x48, 0x8D, 0x44, 0x00, 0x01}); // lea rax, [rax + rax + 1]
+                break;
+        }
+        slot(false, 1);
+        pop(1);
+        return true;
+    }
+
+    // Pops the operand of a conditional jump, setting the zero flag if it is zero
+    template<bool Checked>
+    void condition(Decoded &insn) {
+        if constexpr (Checked) {
+            call(reinterpret_cast<const void *>(&jitCondition<Checked>), &insn);
+            bytes({0x48, 0x85, 0xC0}); // test rax, rax
+        } else {
+            // mov rax, [r12]; add r12, 8; sar rax, 1
+            slot(true, 0);
+            pop(1);
+            bytes({0x48, 0xD1, 0xF8});
+        }
+    }
+
+    // Performs a straight-line instruction, given the BEGIN of the function it belongs to, or nullptr if it is not
+    // known, in which case the arguments and the locals are left to the interpreter
+    template<bool Checked>
+    void step(Decoded &insn, const Decoded *begin) {
+        if constexpr (!Checked) {
+            // the address of a global only depends on the size of the global area
+            auto *globals = __gc_stack_bottom - JitContext<Checked>::code->bf->global_area_size;
+            switch (insn.op) {
+                case Op::NOP:
+                    return;
+                case Op::CONST:
+                    if (insn.a >= -(1 << 29) && insn.a < (1 << 29)) {
+                        // mov qword [r12 - 8], BOX(a); lea r12, [r12 - 8]
+                        bytes({0x49, 0xC7, 0x44, 0x24, 0xF8});
+                        imm32(static_cast<int32_t>(BOX(insn.a)));
+                        pop(-1);
+                        return;
+                    }
+                    break;
+                case Op::DUP:
+                    slot(true, 0);
+                    push();
+                    return;
+                case Op::DROP:
+                    pop(1);
+                    return;
+                case Op::SWAP:
+                    slot(true, 0);
+                    slot(true, 1, true);
+                    slot(false, 1);
+                    slot(false, 0, true);
+                    return;
+                case Op::LD_G:
+                    global(true, globals + insn.a);
+                    push();
+                    return;
+                case Op::ST_G:
+                    slot(true, 0);
+                    global(false, globals + insn.a);
+                    return;
+                case Op::LD_L:
+                case Op::ST_L:
+                case Op::LD_A:
+                case Op::ST_A: {
+                    if (begin == nullptr) {
+                        break;
+                    }
+                    auto local = insn.op == Op::LD_L || insn.op == Op::ST_L;
+                    auto offset = local ? insn.a - begin->b : FRAME_WORDS + begin->a - 1 - insn.a;
+                    if (insn.op == Op::LD_L || insn.op == Op::LD_A) {
+                        frame(true, offset);
+                        push();
+                    } else {
+                        slot(true, 0);
+                        frame(false, offset);
+                    }
+                    return;
+                }
+                default:
+                    if (binop(insn.op)) {
+                        return;
+                    }
+                    break;
+            }
+        }
+        call(reinterpret_cast<const void *>(jitStepOf<Checked>(insn.op)), &insn, insn.op == Op::BEGIN);
+    }
+
+    // Compares the operands of a comparison and jumps if the conditional jump after it would, popping both
+    void compareAndJump(Decoded &insn, const Decoded &cjmp, int target, std::vector<std::pair<size_t, int>> &jumps) {
+        auto cc = conditionCode(insn.op) ^ (cjmp.op == Op::CJMPZ ? 1 : 0);
+        operands(insn.op);
+        pop(2);
+        bytes({0x48, 0x39, 0xC8}); // cmp rax, rcx
+        jump({0x0F, static_cast<unsigned char>(0x80 + cc)}, target, jumps);
+    }
+
+    template<bool Checked>
+    void emit(ThreadedCode &code, Decoded &insn, const Decoded *begin, const std::vector<bool> &compiled,
+              std::vector<std::pair<size_t, int>> &jumps) {
+        auto index = [&](const Decoded *target) { return static_cast<int>(target - code.insns.data()); };
+
+        switch (insn.op) {
+            case Op::HALT:
+                leave(&insn);
+                return;
+            case Op::JMP:
+                jump({0xE9}, index(insn.target), jumps);
+                return;
+            case Op::CJMPZ:
+            case Op::CJMPNZ:
+                condition<Checked>(insn);
+                jump({0x0F, static_cast<unsigned char>(insn.op == Op::CJMPZ ? 0x84 : 0x85)}, index(insn.target),
+                     jumps);
+                return;
+            case Op::CALL:
+            case Op::TAIL_CALL:
+                call(insn.op == Op::CALL ? reinterpret_cast<const void *>(&jitCall<Checked>)
+                                         : reinterpret_cast<const void *>(&jitTailCall<Checked>), &insn);
+                if (compiled[index(insn.target)]) {
+                    jump({0xE9}, index(insn.target), jumps);
+                } else {
+                    leave(insn.target);
+                }
+                return;
+            case Op::CALLC:
+                call(reinterpret_cast<const void *>(&jitCallC<Checked>), &insn);
+                resume();
+                return;
+            case Op::TAIL_CALLC:
+                call(reinterpret_cast<const void *>(&jitTailCallC<Checked>), &insn);
+                resume();
+                return;
+            case Op::END:
+                call(reinterpret_cast<const void *>(&jitEnd<Checked>), &insn, true);
+                resume();
+                return;
+            case Op::SWITCH:
+            case Op::UNPACK:
+                call(insn.op == Op::SWITCH ? reinterpret_cast<const void *>(&jitSwitch<Checked>)
+                                           : reinterpret_cast<const void *>(&jitUnpack<Checked>), &insn);
+                resume();
+                return;
+            default:
+                step<Checked>(insn, begin);
+                return;
+        }
+    }
+
+    // Compiles the functions of verified code, given the function each instruction belongs to, and returns the
+    // number of compiled functions
+    template<bool Checked>
+    int compile(ThreadedCode &code, const std::vector<int> &owner, Interpreter<Checked> &interp) {
+#if LAMA_JIT_SUPPORTED
+        auto n = code.insns.size();
+        std::vector<int> sizes(n, 0);
+        for (size_t i = 0; i < n; i++) {
+            if (owner[i] >= 0) {
+                sizes[owner[i]]++;
+            }
+        }
+        std::vector<bool> compiled(n, false);
+        int functions = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (owner[i] >= 0) {
+                compiled[i] = sizes[owner[i]] <= JIT_MAX_FUNCTION_SIZE;
+                functions += owner[i] == static_cast<int>(i) && compiled[i];
+            }
+        }
+        if (functions == 0) {
+            return 0;
+        }
+
+        // the instructions native jumps go to, which a comparison can not be fused into
+        std::vector<bool> targeted(n, false);
+        for (size_t i = 0; i < n; i++) {
+            auto &insn = code.insns[i];
+            if (compiled[i] && (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ ||
+                                insn.op == Op::CALL || insn.op == Op::TAIL_CALL)) {
+                targeted[insn.target - code.insns.data()] = true;
+            }
+        }
+
+        JitContext<Checked>::interp = &interp;
+        JitContext<Checked>::code = &code;
+        trampoline(&interp.fp);
+        std::vector<size_t> offsets(n, 0);
+        std::vector<bool> fused(n, false);
+        std::vector<std::pair<size_t, int>> jumps;
+        for (size_t i = 0; i < n; i++) {
+            if (!compiled[i]) {
+                continue;
+            }
+            auto &insn = code.insns[i];
+            auto *begin = code.insns[owner[i]].op == Op::BEGIN ? &code.insns[owner[i]] : nullptr;
+            offsets[i] = buffer.size();
+            if (!Checked && conditionCode(insn.op) >= 0 && i + 1 < n && compiled[i + 1] && !targeted[i + 1] &&
+                (code.insns[i + 1].op == Op::CJMPZ || code.insns[i + 1].op == Op::CJMPNZ)) {
+                auto &cjmp = code.insns[++i];
+                compareAndJump(insn, cjmp, static_cast<int>(cjmp.target - code.insns.data()), jumps);
+                fused[i] = true;
+                continue;
+            }
+            emit<Checked>(code, insn, begin, compiled, jumps);
+        }
+        for (auto &[at, target]: jumps) {
+            patch32(at, static_cast<int32_t>(offsets[target] - (at + 4)));
+        }
+
+        auto *memory = static_cast<char *>(install());
+        if (memory == nullptr) {
+            return 0;
+        }
+
+        code.enter = reinterpret_cast<Decoded *(*)(const void *)>(memory);
+        for (size_t i = 0; i < n; i++) {
+            // HALT is only compiled to leave to the interpreter, which must then run it, as are the conditional jumps
+            // fused into the comparison before them
+            if (compiled[i] && code.insns[i].op != Op::HALT && !fused[i]) {
+                code.insns[i].native = memory + offsets[i];
+            }
+        }
+        return functions;
+#else
+        return 0;
+#endif
+    }
+};
+
+#endif //VIRTUAL_MACHINES_JIT_H
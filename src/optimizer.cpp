@@ -0,0 +1,42 @@
+#include <fstream>
+#include <iostream>
+
+#include "bytecode.h"
+#include "inliner.h"
+#include "peephole.h"
+#include "threaded.h"
+#include "verifier.h"
+#include "../bytecode/bytefile.h"
+
+// Optimizes a bytecode file offline: the code reachable from its public symbols is decoded, its small functions are
+// inlined if it is verified, and it is rewritten and laid out again into a file that runs on any engine, with the same
+// string table, globals and public symbols
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <bytecode-file> <output-file>" << std::endl;
+        return 1;
+    }
+
+    auto *bf = readFile(argv[1]);
+    auto code = decodeBytecode(bf);
+    auto before = code.insns.size();
+    auto threaded = decodeThreaded(bf);
+    Verifier verifier(threaded);
+    if (verifier.verify()) {
+        inlineCalls(code, threaded);
+    } else {
+        std::cerr << "Not inlining code that fails verification: " << verifier.reason << std::endl;
+    }
+    optimizePeephole(code);
+    auto file = code.encode();
+
+    std::ofstream out(argv[2], std::ios::binary);
+    out.write(file.data(), static_cast<std::streamsize>(file.size()));
+    if (!out) {
+        std::cerr << "Cannot write " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cerr << before << " -> " << code.insns.size() << " instructions" << std::endl;
+    closeFile(bf);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#ifndef VIRTUAL_MACHINES_PATTERNS_H
+#define VIRTUAL_MACHINES_PATTERNS_H
+
+#include <vector>
+
+#include "common.h"
+#include "threaded.h"
+
+// Compiles sexp and array patterns of case-of branches, such as `x : tl` and `x : z@(y : tl)`, into UNPACK
+// instructions that test the whole pattern and bind the names it introduces at once, without going through ELEM and
+// the runtime for every field. lamac compiles a branch into `DUP` of the scrutinee, the code of its pattern, then the
+// bindings and a DROP of the scrutinee. The code of a pattern, with its value on top of the stack, is one of:
+// - `DROP` for a wildcard or a name;
+// - `CONST c; EQ; CJMPZ drop` for a constant and `PATT k; CJMPZ drop` for a kind pattern;
+// - `DUP; TAG|ARRAY; CJMPNZ head; drop: DROP; JMP fail; head: (DUP; CONST i; ELEM; <pattern of field i>)*; DROP`
+//   for sexps and arrays, whose fields fail to its own `drop`;
+// where `drop` is the one of the enclosing pattern. A binding is `DUP; (CONST i; ELEM)*; ST x; DROP`.
+// The DUP of the pattern and its `head` become UNPACK, which leaves to `drop` when the pattern does not match.
+struct PatternCompiler {
+    ThreadedCode &code;
+    std::vector<int> jumps; // number of jumps to every instruction
+    Unpack pattern;
+
+    explicit PatternCompiler(ThreadedCode &code) : code(code), jumps(code.insns.size(), 0) {
+        for (auto &insn: code.insns) {
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                jumps[index(insn.target)]++;
+            }
+        }
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    bool isProbe(size_t i) const {
+        if (i + 4 >= code.insns.size()) {
+            return false;
+        }
+        auto *insn = &code.insns[i];
+        return insn[0].op == Op::DUP && ((insn[1].op == Op::TAG && insn[1].cache != 0) || insn[1].op == Op::ARRAY) &&
+               insn[2].op == Op::CJMPNZ && insn[3].op == Op::DROP && insn[4].op == Op::JMP;
+    }
+
+    // Parses the pattern of the value on top of the stack at `i` into a new node, and returns the index after its
+    // code, or -1 if it is not one of the known shapes
+    int parse(int i, int parent, int field, int drop) {
+        if (pattern.nodes.size() >= UNPACK_MAX_NODES) {
+            return -1;
+        }
+        auto node = static_cast<int>(pattern.nodes.size());
+        pattern.nodes.push_back({parent, field});
+        auto *insn = &code.insns[i];
+        auto failsTo = [&](const Decoded &jump) { return drop >= 0 && index(jump.target) == drop; };
+
+        if (insn[0].op == Op::DROP) {
+            return i + 1;
+        }
+        if (insn[0].op == Op::CONST && insn[1].op == Op::EQ && insn[2].op == Op::CJMPZ && failsTo(insn[2])) {
+            pattern.nodes[node].test = Op::CONST;
+            pattern.nodes[node].value = insn[0].a;
+            return i + 3;
+        }
+        if (insn[0].op >= Op::PATT_STR_TAG && insn[0].op <= Op::PATT_CLOSURE && insn[1].op == Op::CJMPZ &&
+            failsTo(insn[1])) {
+            pattern.nodes[node].test = insn[0].op;
+            return i + 2;
+        }
+        if (!isProbe(i) || (parent >= 0 && !failsTo(insn[4])) || insn[1].a < 0 || insn[1].a > UNPACK_MAX_NODES) {
+            return -1;
+        }
+        pattern.nodes[node].test = insn[1].op;
+        pattern.nodes[node].value = insn[1].a;
+        if (insn[1].op == Op::TAG) {
+            pattern.nodes[node].tag = static_cast<auint>(UNBOX(insn[1].cache));
+        }
+        auto j = index(insn[2].target);
+        for (int f = 0; f < insn[1].a; f++) {
+            auto *elem = &code.insns[j];
+            if (elem[0].op != Op::DUP || elem[1].op != Op::CONST || elem[1].a != f || elem[2].op != Op::ELEM) {
+                return -1;
+            }
+            j = parse(j + 3, node, f, i + 3);
+            if (j < 0) {
+                return -1;
+            }
+        }
+        return code.insns[j].op == Op::DROP ? j + 1 : -1;
+    }
+
+    int child(int parent, int field) const {
+        for (size_t n = 0; n < pattern.nodes.size(); n++) {
+            if (pattern.nodes[n].parent == parent && pattern.nodes[n].field == field) {
+                return static_cast<int>(n);
+            }
+        }
+        return -1;
+    }
+
+    // Compiles the pattern whose DUP is at `i`. The DUP must follow the one of the branch and the head of the pattern
+    // must only be reached from its CJMPNZ, so that UNPACK can rely on finding the scrutinee twice on the stack.
+    bool compile(int i) {
+        auto *insn = &code.insns[i];
+        auto *head = insn[2].target;
+        if (i == 0 || (insn[-1].op != Op::DUP && insn[-1].op != Op::SWITCH) || jumps[i] != 0 ||
+            jumps[index(head)] != 1 || !isTerminator(head[-1].op)) {
+            return false;
+        }
+        pattern = {};
+        auto j = parse(i, -1, 0, -1);
+        if (j < 0) {
+            return false;
+        }
+        while (code.insns[j].op == Op::DUP) {
+            auto node = 0;
+            auto k = j + 1;
+            for (; code.insns[k].op == Op::CONST && code.insns[k + 1].op == Op::ELEM; k += 2) {
+                node = child(node, code.insns[k].a);
+                if (node < 0) {
+                    return false;
+                }
+            }
+            auto &st = code.insns[k];
+            if (st.op < Op::ST_G || st.op > Op::ST_C || code.insns[k + 1].op != Op::DROP) {
+                return false;
+            }
+            auto type = static_cast<Loc::Type>(static_cast<int>(st.op) - static_cast<int>(Op::ST_G));
+            pattern.bindings.emplace_back(node, Loc(type, st.a));
+            j = k + 2;
+        }
+        if (code.insns[j].op != Op::DROP) {
+            return false;
+        }
+        pattern.body = &code.insns[j + 1];
+        pattern.fail = &insn[3];
+
+        auto *compiled = &code.patterns.emplace_back(std::move(pattern));
+        for (auto *at: {insn, head}) {
+            at->op = Op::UNPACK;
+            at->pattern = compiled;
+        }
+        return true;
+    }
+
+    // Returns the number of compiled patterns
+    int run() {
+        int patterns = 0;
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (isProbe(i)) {
+                patterns += compile(static_cast<int>(i));
+            }
+        }
+        DEBUG("Compiled %d patterns\n", patterns);
+        return patterns;
+    }
+};
+
+inline int compilePatterns(ThreadedCode &code) {
+    return PatternCompiler(code).run();
+}
+
+#endif //VIRTUAL_MACHINES_PATTERNS_H
@@ -0,0 +1,158 @@
+#ifndef VIRTUAL_MACHINES_PEEPHOLE_H
+#define VIRTUAL_MACHINES_PEEPHOLE_H
+
+#include <climits>
+#include <vector>
+
+#include "bytecode.h"
+#include "common.h"
+
+constexpr static int PEEPHOLE_MAX_HOPS = 16;
+
+// Rewrites the naive sequences lamac emits, until none is left:
+// - LINE, and STOP that the switch engine skips, are removed;
+// - `DUP; DROP` is removed, and `ST x; DROP; LD x` becomes `ST x`, which leaves the stored value on the stack;
+// - `CONST a; CONST b; BINOP` becomes the constant result, unless it divides by zero or does not fit an operand;
+// - jumps to unconditional jumps go to their final target, and jumps to the next instruction are removed, or
+//   become DROP when conditional.
+// Only the first instruction of a rewritten sequence may be the target of a jump or a call.
+struct PeepholeOptimizer {
+    Bytecode &code;
+    std::vector<int> references; // number of jumps, calls, closures and public symbols referring to every instruction
+
+    explicit PeepholeOptimizer(Bytecode &code) : code(code) {
+    }
+
+    void count() {
+        references.assign(code.insns.size() + 1, 0);
+        for (auto &insn: code.insns) {
+            if (insn.refers()) {
+                references[insn.target]++;
+            }
+        }
+        for (auto &[name, at]: code.publics) {
+            references[at]++;
+        }
+    }
+
+    BytecodeInsn *at(size_t i) {
+        return i < code.insns.size() && !code.insns[i].removed ? &code.insns[i] : nullptr;
+    }
+
+    // Whether `n` instructions from `i` are still in place, with none but the first referred to
+    bool sequence(size_t i, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            if (at(i + j) == nullptr || (j > 0 && references[i + j] != 0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool fold(const BytecodeInsn &binop, aint lhs, aint rhs, int &result) {
+        aint v;
+        switch (static_cast<BinOp>(binop.opcode - 1)) {
+            case BinOp::PLUS: v = lhs + rhs; break;
+            case BinOp::MINUS: v = lhs - rhs; break;
+            case BinOp::TIMES: v = lhs * rhs; break;
+            case BinOp::DIV: if (rhs == 0) return false; v = lhs / rhs; break;
+            case BinOp::MOD: if (rhs == 0) return false; v = lhs % rhs; break;
+            case BinOp::LT: v = lhs < rhs; break;
+            case BinOp::LTQ: v = lhs <= rhs; break;
+            case BinOp::GT: v = lhs > rhs; break;
+            case BinOp::GTQ: v = lhs >= rhs; break;
+            case BinOp::EQ: v = lhs == rhs; break;
+            case BinOp::NEQ: v = lhs != rhs; break;
+            case BinOp::AND: v = lhs && rhs; break;
+            case BinOp::OR: v = lhs || rhs; break;
+            default: return false;
+        }
+        if (v < INT_MIN || v > INT_MAX) {
+            return false;
+        }
+        result = static_cast<int>(v);
+        return true;
+    }
+
+    // Rewrites the sequence starting at `i`. Returns whether it did.
+    bool rewrite(size_t i) {
+        auto &insn = code.insns[i];
+        if (insn.opcode == OP_LINE || insn.hi() == Instruction::STOP) {
+            insn.removed = true;
+            return true;
+        }
+        if (insn.opcode == OP_DUP && sequence(i, 2) && code.insns[i + 1].opcode == OP_DROP) {
+            insn.removed = code.insns[i + 1].removed = true;
+            return true;
+        }
+        if (insn.hi() == Instruction::ST && sequence(i, 3) && code.insns[i + 1].opcode == OP_DROP) {
+            auto &ld = code.insns[i + 2];
+            if (ld.hi() == Instruction::LD && ld.lo() == insn.lo() && ld.args[0] == insn.args[0]) {
+                code.insns[i + 1].removed = ld.removed = true;
+                return true;
+            }
+        }
+        if (insn.opcode == OP_CONST && sequence(i, 3) && code.insns[i + 1].opcode == OP_CONST &&
+            code.insns[i + 2].hi() == Instruction::BINOP) {
+            int result;
+            if (fold(code.insns[i + 2], insn.args[0], code.insns[i + 1].args[0], result)) {
+                insn.args[0] = result;
+                code.insns[i + 1].removed = code.insns[i + 2].removed = true;
+                return true;
+            }
+        }
+        if (insn.jumps()) {
+            auto target = insn.target;
+            for (int hops = 0; hops < PEEPHOLE_MAX_HOPS && target < code.end() &&
+                               code.insns[target].opcode == OP_JMP && code.insns[target].target != target; hops++) {
+                target = code.insns[target].target;
+            }
+            auto next = i + 1;
+            while (next < code.insns.size() && code.insns[next].removed) {
+                next++;
+            }
+            if (static_cast<size_t>(target) == next) {
+                // a conditional jump still pops its operand
+                if (insn.opcode == OP_JMP) {
+                    insn.removed = true;
+                } else {
+                    insn.opcode = OP_DROP;
+                    insn.args.clear();
+                    insn.target = -1;
+                }
+                return true;
+            }
+            if (target != insn.target) {
+                references[insn.target]--;
+                references[target]++;
+                insn.target = target;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the number of rewrites
+    int run() {
+        int rewrites = 0;
+        for (auto changed = true; changed;) {
+            changed = false;
+            count();
+            for (size_t i = 0; i < code.insns.size(); i++) {
+                if (!code.insns[i].removed && rewrite(i)) {
+                    changed = true;
+                    rewrites++;
+                }
+            }
+            code.compact();
+        }
+        DEBUG("Applied %d peephole rewrites\n", rewrites);
+        return rewrites;
+    }
+};
+
+inline int optimizePeephole(Bytecode &code) {
+    return PeepholeOptimizer(code).run();
+}
+
+#endif //VIRTUAL_MACHINES_PEEPHOLE_H
@@ -0,0 +1,147 @@
+#ifndef VIRTUAL_MACHINES_PRIMITIVES_H
+#define VIRTUAL_MACHINES_PRIMITIVES_H
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime_common.h"
+
+// Inline versions of the primitives of runtime.c that instructions call on every execution, on the same object layout.
+// Each one handles the values it can without failing, and leaves the other ones to its original in the runtime, which
+// reports the failure.
+
+inline aint fastElem(aint p, aint i) {
+    if (UNBOXED(p) || !UNBOXED(i)) {
+        return reinterpret_cast<aint>(Belem(reinterpret_cast<void *>(p), i));
+    }
+    auto *d = TO_DATA(p);
+    auto k = UNBOX(i);
+    switch (TAG(d->data_header)) {
+        case STRING_TAG:
+            return BOX(static_cast<char>(d->contents[k]));
+        case SEXP_TAG:
+            return reinterpret_cast<aint *>(TO_SEXP(p)->contents)[k];
+        default:
+            return reinterpret_cast<aint *>(d->contents)[k];
+    }
+}
+
+// Assignments through a reference (a boxed index) stay in the runtime
+inline aint fastSta(aint x, aint i, aint v) {
+    if (UNBOXED(x) || !UNBOXED(i)) {
+        return reinterpret_cast<aint>(Bsta(reinterpret_cast<void *>(x), i, reinterpret_cast<void *>(v)));
+    }
+    auto *d = TO_DATA(x);
+    auto k = UNBOX(i);
+    switch (TAG(d->data_header)) {
+        case STRING_TAG:
+            reinterpret_cast<char *>(x)[k] = static_cast<char>(UNBOX(v));
+            break;
+        case SEXP_TAG:
+            reinterpret_cast<aint *>(TO_SEXP(x)->contents)[k] = v;
+            break;
+        default:
+            reinterpret_cast<aint *>(x)[k] = v;
+            break;
+    }
+    return v;
+}
+
+// `t` is the boxed hash of the tag and `n` the boxed number of fields, as for Btag
+inline aint fastTag(aint d, aint t, aint n) {
+    if (UNBOXED(d)) {
+        return BOX(0);
+    }
+    auto *r = TO_DATA(d);
+    return BOX(TAG(r->data_header) == SEXP_TAG && TO_SEXP(d)->tag == static_cast<auint>(UNBOX(t)) &&
+               LEN(r->data_header) == static_cast<ptrt>(UNBOX(n)));
+}
+
+inline aint fastArrayPatt(aint d, aint n) {
+    if (UNBOXED(d)) {
+        return BOX(0);
+    }
+    auto *r = TO_DATA(d);
+    return BOX(TAG(r->data_header) == ARRAY_TAG && LEN(r->data_header) == static_cast<ptrt>(UNBOX(n)));
+}
+
+// Kind patterns, with the tag of the boxed values they accept
+inline aint fastTagPatt(aint x, auint tag) {
+    return BOX(!UNBOXED(x) && TAG(TO_DATA(x)->data_header) == tag);
+}
+
+inline aint fastBoxedPatt(aint x) {
+    return BOX(!UNBOXED(x));
+}
+
+inline aint fastUnboxedPatt(aint x) {
+    return BOX(UNBOXED(x));
+}
+
+inline aint fastLength(aint p) {
+    if (UNBOXED(p)) {
+        return Llength(reinterpret_cast<void *>(p));
+    }
+    return BOX(LEN(TO_DATA(p)->data_header));
+}
+
+// Objects are allocated by bumping the current pointer of the heap, with their headers and fields written right away
+// instead of cleared first. The fields are read from the operand stack once the object is allocated, so when the heap
+// is exhausted the collection finds them on the stack, without registering them as extra roots.
+constexpr static bool INLINE_ALLOCATION = DATA_HEADER_SZ == 2 * sizeof(aint); // objects carry no debugging id
+
+inline data *allocObject(size_t words) {
+    if (heap.current + words > heap.end) [[unlikely]] {
+        return static_cast<data *>(gc_alloc(words));
+    }
+    auto *obj = reinterpret_cast<data *>(heap.current);
+    heap.current += words;
+    return obj;
+}
+
+// `args` holds the boxed hash of the tag followed by the `n` fields in reverse, as for Bsexp
+inline aint fastSexp(aint *args, aint n) {
+    if constexpr (!INLINE_ALLOCATION) {
+        return reinterpret_cast<aint>(Bsexp(args, BOX(n + 1)));
+    }
+    auto *obj = reinterpret_cast<sexp *>(allocObject(3 + n));
+    obj->data_header = SEXP_TAG | static_cast<auint>(n) << 3;
+    obj->forward_address = 0;
+    obj->tag = UNBOX(args[0]);
+    auto *fields = reinterpret_cast<aint *>(obj->contents);
+    for (aint i = 0; i < n; i++) {
+        fields[i] = args[n - i];
+    }
+    return reinterpret_cast<aint>(reinterpret_cast<data *>(obj)->contents);
+}
+
+// `args` holds the `n` elements in reverse, as for Barray
+inline aint fastArray(aint *args, aint n) {
+    if constexpr (!INLINE_ALLOCATION) {
+        return reinterpret_cast<aint>(Barray(args, BOX(n)));
+    }
+    auto *obj = allocObject(2 + n);
+    obj->data_header = ARRAY_TAG | static_cast<auint>(n) << 3;
+    obj->forward_address = 0;
+    auto *elements = reinterpret_cast<aint *>(obj->contents);
+    for (aint i = 0; i < n; i++) {
+        elements[i] = args[n - 1 - i];
+    }
+    return reinterpret_cast<aint>(obj->contents);
+}
+
+// `args` holds the address of the code followed by the `n` captured values in reverse, as for Bclosure
+inline aint fastClosure(aint *args, aint n) {
+    if constexpr (!INLINE_ALLOCATION) {
+        return reinterpret_cast<aint>(Bclosure(args, BOX(n)));
+    }
+    auto *obj = allocObject(3 + n);
+    obj->data_header = CLOSURE_TAG | static_cast<auint>(n + 1) << 3;
+    obj->forward_address = 0;
+    auto *words = reinterpret_cast<aint *>(obj->contents);
+    words[0] = args[0];
+    for (aint i = 1; i <= n; i++) {
+        words[i] = args[n + 1 - i];
+    }
+    return reinterpret_cast<aint>(obj->contents);
+}
+
+#endif //VIRTUAL_MACHINES_PRIMITIVES_H
@@ -19,7 +19,7 @@ struct ProcessorState {
         if (bf != nullptr && ip != nullptr) {
             fprintf(
                 stderr, "Failure.\n\tinstruction offset: 0x%.8lx\n\topcode: %d\n",
-                ip - bf->code_ptr - 1, opcode);
+                get_original_offset(bf, ip - bf->code_ptr - 1), opcode);
         }
 
         fprintf(stderr, "*** FAILURE: ");
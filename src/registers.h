@@ -0,0 +1,527 @@
+#ifndef VIRTUAL_MACHINES_REGISTERS_H
+#define VIRTUAL_MACHINES_REGISTERS_H
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "threaded.h"
+#include "verifier.h"
+
+#define REGISTER_BINOPS(X) \
+    X(ADD, +)              \
+    X(SUB, -)              \
+    X(MUL, *)              \
+    X(DIV, /)              \
+    X(MOD, %)              \
+    X(LT, <)               \
+    X(LTQ, <=)             \
+    X(GT, >)               \
+    X(GTQ, >=)             \
+    X(EQ, ==)              \
+    X(NEQ, !=)             \
+    X(AND, &&)             \
+    X(OR, ||)
+
+// BIN_<op> combines two slots, BINI_<op> a slot and an immediate
+#define REGISTER_OPS(X)                                                                                   \
+    X(HALT) X(MOV) X(MOVI) X(LDG) X(STG) X(LDC) X(STC) X(JMP) X(JZ) X(JNZ) X(BEGIN) X(CALL) X(CALLC) X(END) \
+    X(TAIL_CALL) X(TAIL_CALLC) X(STACK)                                                                     \
+    X(BIN_ADD) X(BIN_SUB) X(BIN_MUL) X(BIN_DIV) X(BIN_MOD) X(BIN_LT) X(BIN_LTQ) X(BIN_GT) X(BIN_GTQ)        \
+    X(BIN_EQ) X(BIN_NEQ) X(BIN_AND) X(BIN_OR)                                                               \
+    X(BINI_ADD) X(BINI_SUB) X(BINI_MUL) X(BINI_DIV) X(BINI_MOD) X(BINI_LT) X(BINI_LTQ) X(BINI_GT)           \
+    X(BINI_GTQ) X(BINI_EQ) X(BINI_NEQ) X(BINI_AND) X(BINI_OR)
+
+enum class RegOp {
+#define REG_OP_ENUM(name) name,
+    REGISTER_OPS(REG_OP_ENUM)
+#undef REG_OP_ENUM
+};
+
+// Instruction of the register code. Slots are offsets from the frame pointer: arguments and locals are the ones of
+// the stack machine, and the operand stack value at depth k of a function with n locals lives in register k, the
+// slot -n - 1 - k that the stack machine pushes it to.
+struct RegInsn {
+    const void *handler = nullptr;
+    RegOp op = RegOp::HALT;
+    int dst = 0;
+    int a = 0; // source slot, immediate, capture index, or for the instructions running on the stack, its top
+    int b = 0; // source slot or immediate
+    int jump = -1; // index of the jump target until linked
+    union {
+        RegInsn *target = nullptr;
+        aint *global;
+    };
+    Decoded *insn = nullptr; // instruction it was translated from, for its operands and failure reports
+};
+
+struct RegisterCode {
+    std::vector<RegInsn> insns;
+    std::vector<RegInsn *> functions; // decoded instruction index -> translation of the function starting there
+    RegInsn *main = nullptr;
+};
+
+// Translates verified threaded code into register code, one function at a time. The operand stack is tracked
+// symbolically: loads of arguments, locals and constants are not executed but folded into the instructions using
+// them, so `LD x; LD y; ADD; ST z; DROP` becomes a single `z <- x + y`, and DROP disappears.
+//
+// The values of the symbolic stack are written to their registers before everything that reads the stack from memory
+// or may run the GC (calls, END, and the instructions left to the stack machine semantics, which run as STACK on
+// the registers), and at the boundaries of basic blocks. These instructions set `__gc_stack_top` to the register of
+// the current depth, which is the GC root description of the register code: the GC scans exactly the values the
+// stack machine would have on its stack at that point, and registers above the depth are dead.
+struct RegisterTranslator {
+    struct Value {
+        enum class Kind { REG, SLOT, CONST } kind;
+        int value; // the slot for SLOT, the unboxed value for CONST
+    };
+
+    ThreadedCode &code;
+    const Verifier &verifier;
+    RegisterCode &out;
+    std::vector<Value> stack;
+    std::vector<int> starts; // decoded instruction index -> index of its translation
+    int nlocals = 0;
+
+    RegisterTranslator(ThreadedCode &code, const Verifier &verifier, RegisterCode &out)
+        : code(code), verifier(verifier), out(out), starts(code.insns.size(), -1) {
+    }
+
+    int reg(size_t k) const {
+        return -nlocals - 1 - static_cast<int>(k);
+    }
+
+    int top() const {
+        return reg(stack.size());
+    }
+
+    void emit(RegOp op, Decoded *insn, int dst = 0, int a = 0, int b = 0) {
+        RegInsn r;
+        r.op = op;
+        r.insn = insn;
+        r.dst = dst;
+        r.a = a;
+        r.b = b;
+        out.insns.push_back(r);
+    }
+
+    void push(Value v) {
+        stack.push_back(v);
+    }
+
+    void materialize(size_t k, Decoded *insn) {
+        auto &v = stack[k];
+        if (v.kind == Value::Kind::SLOT && v.value != reg(k)) {
+            emit(RegOp::MOV, insn, reg(k), v.value);
+        } else if (v.kind == Value::Kind::CONST) {
+            emit(RegOp::MOVI, insn, reg(k), v.value);
+        }
+        v = {Value::Kind::REG, 0};
+    }
+
+    void flush(Decoded *insn) {
+        for (size_t k = 0; k < stack.size(); k++) {
+            materialize(k, insn);
+        }
+    }
+
+    // Slot holding the value at depth k
+    int operand(size_t k, Decoded *insn) {
+        auto &v = stack[k];
+        if (v.kind == Value::Kind::SLOT) {
+            return v.value;
+        }
+        materialize(k, insn);
+        return reg(k);
+    }
+
+    void store(int slot, Decoded *insn) {
+        auto k = stack.size() - 1;
+        auto v = stack[k];
+        if (v.kind == Value::Kind::SLOT && v.value == slot) {
+            return;
+        }
+        for (size_t i = 0; i < stack.size(); i++) {
+            if (stack[i].kind == Value::Kind::SLOT && stack[i].value == slot) {
+                materialize(i, insn);
+            }
+        }
+        if (v.kind == Value::Kind::CONST) {
+            emit(RegOp::MOVI, insn, slot, v.value);
+        } else {
+            emit(RegOp::MOV, insn, slot, operand(k, insn));
+        }
+    }
+
+    void pop(int n) {
+        stack.resize(stack.size() - n);
+    }
+
+    void translate() {
+        out.insns.clear();
+        emit(RegOp::HALT, nullptr);
+
+        std::vector<std::vector<int>> functions(code.insns.size());
+        for (size_t i = 0; i < code.insns.size(); i++) {
+            if (verifier.owner[i] >= 0) {
+                functions[verifier.owner[i]].push_back(static_cast<int>(i));
+            }
+        }
+        std::vector<bool> targets(code.insns.size(), false);
+        for (auto &insn: code.insns) {
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                targets[insn.target - code.insns.data()] = true;
+            }
+        }
+
+        std::vector<int> entries(code.insns.size(), -1);
+        for (size_t e = 0; e < functions.size(); e++) {
+            if (!functions[e].empty()) {
+                // the body may jump back above the prologue, but it is translated after it
+                std::ranges::stable_partition(functions[e], [&](int i) { return i >= static_cast<int>(e); });
+                entries[e] = static_cast<int>(out.insns.size());
+                translateFunction(functions[e], targets);
+            }
+        }
+
+        for (auto &r: out.insns) {
+            if (r.op == RegOp::JMP || r.op == RegOp::JZ || r.op == RegOp::JNZ) {
+                r.target = &out.insns[starts[r.jump]];
+            } else if (r.op == RegOp::CALL || r.op == RegOp::TAIL_CALL) {
+                r.target = &out.insns[entries[r.jump]];
+            }
+        }
+        out.functions.assign(code.insns.size(), nullptr);
+        for (size_t e = 0; e < entries.size(); e++) {
+            if (entries[e] >= 0) {
+                out.functions[e] = &out.insns[entries[e]];
+            }
+        }
+        out.main = out.functions[code.entry(code.bf->entrypoint_ptr - code.bf->code_ptr) - code.insns.data()];
+    }
+
+    void translateFunction(const std::vector<int> &indices, const std::vector<bool> &targets) {
+        auto &begin = code.insns[indices.front()];
+        auto nargs = begin.a;
+        nlocals = begin.b;
+        stack.clear();
+        emit(RegOp::BEGIN, &begin);
+
+        auto arg = [&](int i) { return FRAME_WORDS + nargs - 1 - i; };
+        auto local = [&](int i) { return i - nlocals; };
+
+        bool live = true;
+        for (auto i: indices) {
+            auto *insn = &code.insns[i];
+            if (insn->op == Op::BEGIN) {
+                continue;
+            }
+            if (targets[i]) {
+                if (live) {
+                    flush(insn);
+                }
+                stack.assign(verifier.depth[i], {Value::Kind::REG, 0});
+            }
+            starts[i] = static_cast<int>(out.insns.size());
+            live = !isTerminator(insn->op);
+
+            switch (insn->op) {
+                case Op::NOP:
+                    break;
+#define TRANSLATE_BINOP(name, _)                                                                             \
+                case Op::name: {                                                                             \
+                    auto k = stack.size() - 2;                                                               \
+                    auto rhs = stack[k + 1];                                                                 \
+                    auto lhs = operand(k, insn);                                                             \
+                    if (rhs.kind == Value::Kind::CONST) {                                                    \
+                        emit(RegOp::BINI_##name, insn, reg(k), lhs, rhs.value);                              \
+                    } else {                                                                                 \
+                        emit(RegOp::BIN_##name, insn, reg(k), lhs, operand(k + 1, insn));                    \
+                    }                                                                                        \
+                    pop(2);                                                                                  \
+                    push({Value::Kind::REG, 0});                                                             \
+                    break;                                                                                   \
+                }
+                REGISTER_BINOPS(TRANSLATE_BINOP)
+#undef TRANSLATE_BINOP
+                case Op::CONST:
+                    push({Value::Kind::CONST, insn->a});
+                    break;
+                case Op::LD_L:
+                    push({Value::Kind::SLOT, local(insn->a)});
+                    break;
+                case Op::LD_A:
+                    push({Value::Kind::SLOT, arg(insn->a)});
+                    break;
+                case Op::LD_G: {
+                    emit(RegOp::LDG, insn, top());
+                    out.insns.back().global = __gc_stack_bottom - code.bf->global_area_size + insn->a;
+                    push({Value::Kind::REG, 0});
+                    break;
+                }
+                case Op::LD_C:
+                    emit(RegOp::LDC, insn, top(), insn->a);
+                    push({Value::Kind::REG, 0});
+                    break;
+                case Op::ST_L:
+                    store(local(insn->a), insn);
+                    break;
+                case Op::ST_A:
+                    store(arg(insn->a), insn);
+                    break;
+                case Op::ST_G: {
+                    emit(RegOp::STG, insn, 0, operand(stack.size() - 1, insn));
+                    out.insns.back().global = __gc_stack_bottom - code.bf->global_area_size + insn->a;
+                    break;
+                }
+                case Op::ST_C:
+                    emit(RegOp::STC, insn, 0, operand(stack.size() - 1, insn), insn->a);
+                    break;
+                case Op::DROP:
+                    pop(1);
+                    break;
+                case Op::DUP: {
+                    auto v = stack.back();
+                    if (v.kind == Value::Kind::REG) {
+                        v = {Value::Kind::SLOT, reg(stack.size() - 1)};
+                    }
+                    push(v);
+                    break;
+                }
+                case Op::JMP:
+                    flush(insn);
+                    emit(RegOp::JMP, insn);
+                    out.insns.back().jump = static_cast<int>(insn->target - code.insns.data());
+                    break;
+                case Op::CJMPZ:
+                case Op::CJMPNZ: {
+                    auto condition = operand(stack.size() - 1, insn);
+                    pop(1);
+                    flush(insn);
+                    emit(insn->op == Op::CJMPZ ? RegOp::JZ : RegOp::JNZ, insn, 0, condition);
+                    out.insns.back().jump = static_cast<int>(insn->target - code.insns.data());
+                    break;
+                }
+                case Op::CALL:
+                case Op::CALLC:
+                case Op::TAIL_CALL:
+                case Op::TAIL_CALLC: {
+                    flush(insn);
+                    if (insn->op == Op::CALL || insn->op == Op::TAIL_CALL) {
+                        emit(insn->op == Op::CALL ? RegOp::CALL : RegOp::TAIL_CALL, insn, 0, top());
+                        out.insns.back().jump = static_cast<int>(insn->target - code.insns.data());
+                    } else {
+                        emit(insn->op == Op::CALLC ? RegOp::CALLC : RegOp::TAIL_CALLC, insn, 0, top());
+                    }
+                    auto [pops, pushes] = stackEffect(*insn);
+                    pop(pops);
+                    push({Value::Kind::REG, 0});
+                    break;
+                }
+                case Op::END:
+                    materialize(stack.size() - 1, insn);
+                    emit(RegOp::END, insn, 0, top());
+                    break;
+                case Op::HALT:
+                    emit(RegOp::HALT, insn);
+                    break;
+                default: {
+                    flush(insn);
+                    emit(RegOp::STACK, insn, 0, top());
+                    auto [pops, pushes] = stackEffect(*insn);
+                    pop(pops);
+                    for (int j = 0; j < pushes; j++) {
+                        push({Value::Kind::REG, 0});
+                    }
+                    break;
+                }
+            }
+        }
+    }
+};
+
+inline RegisterCode translateRegisters(ThreadedCode &code, const Verifier &verifier) {
+    RegisterCode out;
+    RegisterTranslator(code, verifier, out).translate();
+    return out;
+}
+
+// Runs the register code with direct-threaded dispatch. Frames and the call stack are the ones of the stack machine,
+// with return addresses being pointers to register instructions; STACK instructions run the semantics of
+// `Interpreter` on the registers, through the entry points of the JIT.
+template<bool Checked>
+void runRegisters(RegisterCode &code, ThreadedCode &threaded, Interpreter<Checked> &interp) {
+    static const void *labels[] = {
+#define REG_OP_LABEL(name) &&op_##name,
+        REGISTER_OPS(REG_OP_LABEL)
+#undef REG_OP_LABEL
+    };
+    for (auto &insn: code.insns) {
+        insn.handler = labels[static_cast<int>(insn.op)];
+    }
+    JitContext<Checked>::interp = &interp;
+    JitContext<Checked>::code = &threaded;
+
+    auto &state = interp.state;
+    RegInsn *pc = code.main;
+    aint *fp = nullptr;
+
+    interp.call(reinterpret_cast<aint>(&code.insns.front()), false);
+
+#define REG_DISPATCH() goto *pc->handler
+#define REG_NEXT()     \
+    do {               \
+        ++pc;          \
+        REG_DISPATCH(); \
+    } while (0)
+#define REG_BINOP(name, op)                                                                      \
+    op_BIN_##name:                                                                               \
+        fp[pc->dst] = BOX(UNBOX(fp[pc->a]) op UNBOX(fp[pc->b]));                                 \
+        REG_NEXT();                                                                              \
+    op_BINI_##name:                                                                              \
+        fp[pc->dst] = BOX(UNBOX(fp[pc->a]) op pc->b);                                            \
+        REG_NEXT();
+#define REG_BINOP_DIV(name, op)                                                                  \
+    op_BIN_##name:                                                                               \
+        if (UNBOX(fp[pc->b]) == 0) {                                                             \
+            jitSync<Checked>(pc->insn);                                                          \
+            state.fail("Attempt to divide %d by zero when executing operation %s", UNBOX(fp[pc->a]), #op); \
+        }                                                                                        \
+        fp[pc->dst] = BOX(UNBOX(fp[pc->a]) op UNBOX(fp[pc->b]));                                 \
+        REG_NEXT();                                                                              \
+    op_BINI_##name:                                                                              \
+        if (pc->b == 0) {                                                                        \
+            jitSync<Checked>(pc->insn);                                                          \
+            state.fail("Attempt to divide %d by zero when executing operation %s", UNBOX(fp[pc->a]), #op); \
+        }                                                                                        \
+        fp[pc->dst] = BOX(UNBOX(fp[pc->a]) op pc->b);                                            \
+        REG_NEXT();
+
+    REG_DISPATCH();
+
+    REG_BINOP(ADD, +)
+    REG_BINOP(SUB, -)
+    REG_BINOP(MUL, *)
+    REG_BINOP_DIV(DIV, /)
+    REG_BINOP_DIV(MOD, %)
+    REG_BINOP(LT, <)
+    REG_BINOP(LTQ, <=)
+    REG_BINOP(GT, >)
+    REG_BINOP(GTQ, >=)
+    REG_BINOP(EQ, ==)
+    REG_BINOP(NEQ, !=)
+    REG_BINOP(AND, &&)
+    REG_BINOP(OR, ||)
+
+op_HALT:
+    return;
+
+op_MOV:
+    fp[pc->dst] = fp[pc->a];
+    REG_NEXT();
+
+op_MOVI:
+    fp[pc->dst] = BOX(pc->a);
+    REG_NEXT();
+
+op_LDG:
+    fp[pc->dst] = *pc->global;
+    REG_NEXT();
+
+op_STG:
+    *pc->global = fp[pc->a];
+    REG_NEXT();
+
+op_LDC:
+    fp[pc->dst] = *jitSync<Checked>(pc->insn).closure(pc->a);
+    REG_NEXT();
+
+op_STC:
+    *jitSync<Checked>(pc->insn).closure(pc->b) = fp[pc->a];
+    REG_NEXT();
+
+op_JMP:
+    pc = pc->target;
+    REG_DISPATCH();
+
+op_JZ:
+    if (UNBOX(fp[pc->a]) == 0) {
+        pc = pc->target;
+        REG_DISPATCH();
+    }
+    REG_NEXT();
+
+op_JNZ:
+    if (UNBOX(fp[pc->a]) != 0) {
+        pc = pc->target;
+        REG_DISPATCH();
+    }
+    REG_NEXT();
+
+op_BEGIN: {
+    auto *begin = pc->insn;
+    jitSync<Checked>(begin).processBegin(state, begin->a, begin->b, begin->depth);
+    fp = interp.frame_pointer();
+    REG_NEXT();
+}
+
+op_CALL:
+    __gc_stack_top = fp + pc->a;
+    interp.call(reinterpret_cast<aint>(pc + 1), pc->insn->b != 0);
+    pc = pc->target;
+    REG_DISPATCH();
+
+op_CALLC: {
+    __gc_stack_top = fp + pc->a;
+    auto *entry = closureEntry(threaded, jitSync<Checked>(pc->insn), pc->insn);
+    auto *function = code.functions[entry - threaded.insns.data()];
+    if (function == nullptr || entry->a != pc->insn->a) {
+        state.fail("Closure at %.8lx does not accept %d arguments",
+                   get_original_offset(threaded.bf, entry->ip - threaded.bf->code_ptr - 1), pc->insn->a);
+    }
+    interp.call(reinterpret_cast<aint>(pc + 1), true);
+    pc = function;
+    REG_DISPATCH();
+}
+
+op_END:
+    __gc_stack_top = fp + pc->a;
+    pc = reinterpret_cast<RegInsn *>(jitSync<Checked>(pc->insn).leave());
+    if (pc->op != RegOp::HALT) {
+        fp = interp.frame_pointer();
+    }
+    REG_DISPATCH();
+
+op_TAIL_CALL:
+    __gc_stack_top = fp + pc->a;
+    jitSync<Checked>(pc->insn).tailCall(pc->insn->a, pc->insn->b != 0);
+    pc = pc->target;
+    REG_DISPATCH();
+
+op_TAIL_CALLC: {
+    __gc_stack_top = fp + pc->a;
+    auto *entry = closureEntry(threaded, jitSync<Checked>(pc->insn), pc->insn);
+    auto *function = code.functions[entry - threaded.insns.data()];
+    if (function == nullptr || entry->a != pc->insn->a) {
+        state.fail("Closure at %.8lx does not accept %d arguments",
+                   get_original_offset(threaded.bf, entry->ip - threaded.bf->code_ptr - 1), pc->insn->a);
+    }
+    interp.tailCall(pc->insn->a, true);
+    pc = function;
+    REG_DISPATCH();
+}
+
+op_STACK:
+    __gc_stack_top = fp + pc->a;
+    jitStepOf<Checked>(pc->insn->op)(pc->insn);
+    REG_NEXT();
+
+#undef REG_BINOP_DIV
+#undef REG_BINOP
+#undef REG_NEXT
+#undef REG_DISPATCH
+}
+
+#endif //VIRTUAL_MACHINES_REGISTERS_H
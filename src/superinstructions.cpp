@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Generates the list of superinstructions of the threaded engine from a `lama_analyzer` profile: the most frequent
+// pairs of adjacent instructions, with their operands ignored, become a single handler each.
+
+// Operation of the threaded code an instruction printed by the analyzer is decoded into
+std::string operation(const std::string &instruction) {
+    static const char *binops[] = {"ADD", "SUB", "MUL", "DIV", "MOD", "LT", "LTQ", "GT", "GTQ", "EQ", "NEQ", "AND", "OR"};
+    static const char *patts[] = {
+        "PATT_STR", "PATT_STR_TAG", "PATT_ARRAY", "PATT_SEXP", "PATT_BOXED", "PATT_UNBOXED", "PATT_CLOSURE"
+    };
+    static const char *locs[] = {"G", "L", "A", "C"};
+    static const std::vector<std::string> plain = {
+        "CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "RET", "DROP", "DUP", "SWAP", "ELEM", "LDA", "BEGIN",
+        "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LREAD", "LWRITE", "LLENGTH", "LSTRING", "BARRAY"
+    };
+
+    std::istringstream in(instruction);
+    std::string mnemonic;
+    int operand = -1;
+    in >> mnemonic >> operand;
+
+    if (mnemonic == "BINOP") {
+        return operand >= 0 && operand < 13 ? binops[operand] : "";
+    }
+    if (mnemonic == "PATT") {
+        return operand >= 0 && operand < 7 ? patts[operand] : "PATT";
+    }
+    if (mnemonic == "LD" || mnemonic == "ST") {
+        return operand >= 0 && operand < 4 ? mnemonic + "_" + locs[operand] : "";
+    }
+    if (mnemonic == "CJMPz" || mnemonic == "CJMPnz") {
+        return mnemonic == "CJMPz" ? "CJMPZ" : "CJMPNZ";
+    }
+    if (std::ranges::find(plain, mnemonic) != plain.end()) {
+        return mnemonic;
+    }
+    return ""; // LINE is dropped from the threaded code, so the pairs it takes part in never occur there
+}
+
+// Only instructions that always pass control to the next one can start a superinstruction
+bool canStart(const std::string &op) {
+    static const std::vector<std::string> control = {
+        "JMP", "END", "CJMPZ", "CJMPNZ", "CALL", "CALLC", "FAIL", "STI", "RET", "LDA", "PATT"
+    };
+    return !op.empty() && std::ranges::find(control, op) == control.end();
+}
+
+bool isMnemonic(const std::string &s) {
+    std::istringstream in(s);
+    std::string mnemonic;
+    in >> mnemonic;
+    return mnemonic == "LINE" || mnemonic == "BINOP" || mnemonic == "PATT" || mnemonic == "LD" || mnemonic == "ST" ||
+           mnemonic == "CJMPz" || mnemonic == "CJMPnz" || !operation(mnemonic).empty();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " <profile> <count> <output-header>" << std::endl;
+        return 1;
+    }
+    auto limit = std::stoi(argv[2]);
+
+    std::map<std::pair<std::string, std::string>, long> counts;
+    std::ifstream profile(argv[1]);
+    if (!profile) {
+        std::cerr << "Cannot open profile " << argv[1] << std::endl;
+        return 1;
+    }
+    std::string line;
+    std::pair<std::string, std::string> pair;
+    while (std::getline(profile, line)) {
+        if (line.starts_with("Sequence <")) {
+            pair = {};
+            auto sequence = line.substr(10, line.rfind(">:") - 10);
+            // string operands may contain the separator, so split where the second instruction starts
+            for (auto pos = sequence.find(", "); pos != std::string::npos; pos = sequence.find(", ", pos + 1)) {
+                if (isMnemonic(sequence.substr(pos + 2))) {
+                    pair = {operation(sequence.substr(0, pos)), operation(sequence.substr(pos + 2))};
+                    break;
+                }
+            }
+        } else if (!pair.first.empty() && !pair.second.empty() && canStart(pair.first)) {
+            std::istringstream in(line);
+            long count = 0;
+            in >> count;
+            counts[pair] += count;
+            pair = {};
+        }
+    }
+
+    std::vector<std::pair<long, std::pair<std::string, std::string>>> sorted;
+    for (auto &[p, count]: counts) {
+        sorted.emplace_back(count, p);
+    }
+    std::ranges::stable_sort(sorted, [](auto &p1, auto &p2) { return p1.first > p2.first; });
+    if (static_cast<int>(sorted.size()) > limit) {
+        sorted.resize(std::max(limit, 0));
+    }
+
+    std::ofstream out(argv[3]);
+    out << "// Generated by lama_superinstructions from " << argv[1] << ", do not edit\n";
+    out << "#define SUPERINSTRUCTIONS(X)";
+    for (auto &[count, p]: sorted) {
+        out << " \\\n    X(" << p.first << ", " << p.second << ")";
+    }
+    out << "\n";
+    return out ? 0 : 1;
+}
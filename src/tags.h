@@ -0,0 +1,46 @@
+#ifndef VIRTUAL_MACHINES_TAGS_H
+#define VIRTUAL_MACHINES_TAGS_H
+
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+#include "../runtime/runtime_common.h"
+
+// Tags of the SEXP and TAG operands, hashed once at load time. The names of the interned hashes are also what the
+// runtime prints sexps with, instead of decoding them into the static buffer of `de_hash`.
+struct TagTable {
+    std::unordered_map<const char *, aint> hashes; // operand -> boxed hash, 0 for invalid tags
+    std::unordered_map<aint, std::string> names; // unboxed hash -> name
+
+    // Returns the boxed hash of a tag, or 0 if it is invalid, leaving the failure to the instructions using it
+    aint intern(char *tag) {
+        auto [it, inserted] = hashes.try_emplace(tag, 0);
+        if (inserted) {
+            it->second = LtagTryHash(tag);
+            if (it->second != 0) {
+                names.try_emplace(UNBOX(it->second), de_hash(UNBOX(it->second)));
+            }
+        }
+        return it->second;
+    }
+
+    char *name(aint hash) {
+        auto it = names.find(hash);
+        return it == names.end() ? nullptr : it->second.data();
+    }
+};
+
+inline TagTable tagTable;
+
+inline char *internedTagName(aint hash) {
+    return tagTable.name(hash);
+}
+
+// Boxed hash of the tag operand of a decoded instruction
+inline aint internTag(char *tag) {
+    de_hash_lookup = &internedTagName;
+    return tagTable.intern(tag);
+}
+
+#endif //VIRTUAL_MACHINES_TAGS_H
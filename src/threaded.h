@@ -0,0 +1,1131 @@
+#ifndef VIRTUAL_MACHINES_THREADED_H
+#define VIRTUAL_MACHINES_THREADED_H
+
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "common.h"
+#include "interpreter.h"
+#include "processor.h"
+#include "superinstructions.h"
+#include "tags.h"
+#include "../bytecode/bytefile.h"
+
+// Operations of the pre-decoded code. Immediate variants (binary operators, patterns, location kinds) get an
+// operation of their own, so that handlers never switch on their operands, as do the binary operators whose operands
+// are proven to be integers (see integers.h). Straight-line operations only act on the interpreter state, control
+// operations change the instruction pointer themselves.
+#define STRAIGHT_OPS(X) \
+    X(NOP) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(LT) X(LTQ) X(GT) X(GTQ) X(EQ) X(NEQ) X(AND) X(OR) \
+    X(CONST) X(STRING) X(SEXP) X(STI) X(STA) X(RET) X(DROP) X(DUP) X(SWAP) X(ELEM) \
+    X(LD_G) X(LD_L) X(LD_A) X(LD_C) X(LDA) X(ST_G) X(ST_L) X(ST_A) X(ST_C) \
+    X(BEGIN) X(CLOSURE) X(TAG) X(ARRAY) X(FAIL) \
+    X(PATT_STR) X(PATT_STR_TAG) X(PATT_ARRAY) X(PATT_SEXP) X(PATT_BOXED) X(PATT_UNBOXED) X(PATT_CLOSURE) X(PATT) \
+    X(LREAD) X(LWRITE) X(LLENGTH) X(LSTRING) X(BARRAY) \
+    X(ADD_INT) X(SUB_INT) X(MUL_INT) X(LT_INT) X(LTQ_INT) X(GT_INT) X(GTQ_INT) X(EQ_INT) X(NEQ_INT)
+
+#define CONTROL_OPS(X) \
+    X(HALT) X(JMP) X(CJMPZ) X(CJMPNZ) X(CALL) X(CALLC) X(END) X(TAIL_CALL) X(TAIL_CALLC) X(SWITCH) X(UNPACK)
+
+#define THREADED_OPS(X) STRAIGHT_OPS(X) CONTROL_OPS(X)
+
+enum class Op : unsigned char {
+#define OP_ENUM(name) name,
+    THREADED_OPS(OP_ENUM)
+#undef OP_ENUM
+    COUNT
+};
+
+// Kind of the receiver a quickened instruction has observed. An instruction starts `UNSEEN`, specializes on the
+// first receiver it gets and becomes `GENERIC` for good once a receiver of another kind shows up.
+enum class Kind : unsigned char {
+    UNSEEN,
+    GENERIC,
+    UNBOXED,
+    STRING,
+    ARRAY,
+    SEXP,
+    CLOSURE
+};
+
+inline Kind kindOf(aint value) {
+    if (UNBOXED(value)) {
+        return Kind::UNBOXED;
+    }
+    switch (TAG(TO_DATA(value)->data_header)) {
+        case STRING_TAG:
+            return Kind::STRING;
+        case ARRAY_TAG:
+            return Kind::ARRAY;
+        case SEXP_TAG:
+            return Kind::SEXP;
+        case CLOSURE_TAG:
+            return Kind::CLOSURE;
+        default:
+            return Kind::GENERIC;
+    }
+}
+
+constexpr static int INLINE_CACHE_SIZE = 4;
+
+// Closure targets seen by a closure call site, with their entry instructions already checked to accept the call
+struct InlineCache {
+    aint targets[INLINE_CACHE_SIZE]{};
+    struct Decoded *entries[INLINE_CACHE_SIZE]{};
+    int size = 0;
+};
+
+// Arms of a chain of case-of probes compiled into a SWITCH (see dispatch.h): the instruction a scrutinee of each kind
+// continues at, with sexps first looked up by tag and arity and arrays by length
+struct Dispatch {
+    struct Arm {
+        auint tag = 0;
+        int arity = 0;
+        struct Decoded *target = nullptr;
+        bool dup = false; // whether the arm expects the scrutinee twice on the stack
+    };
+    std::vector<Arm> sexps; // open addressing on `dispatchHash`, a power of two in size
+    std::vector<Arm> arrays;
+    Arm kinds[static_cast<int>(Kind::CLOSURE) + 1]{};
+};
+
+inline size_t dispatchHash(auint tag, int arity) {
+    return (tag ^ static_cast<auint>(arity) * 0x9E3779B9u) * 0x9E3779B97F4A7C15ull >> 32;
+}
+
+inline const Dispatch::Arm *findArm(const Dispatch &cases, aint value, Kind kind) {
+    auto arity = static_cast<int>(LEN(TO_DATA(value)->data_header));
+    if (kind == Kind::SEXP && !cases.sexps.empty()) {
+        auto tag = TO_SEXP(value)->tag;
+        auto mask = cases.sexps.size() - 1;
+        for (auto h = dispatchHash(tag, arity) & mask; cases.sexps[h].target != nullptr; h = (h + 1) & mask) {
+            if (cases.sexps[h].tag == tag && cases.sexps[h].arity == arity) {
+                return &cases.sexps[h];
+            }
+        }
+    } else if (kind == Kind::ARRAY) {
+        for (auto &arm: cases.arrays) {
+            if (arm.arity == arity) {
+                return &arm;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Arm a scrutinee continues at
+inline const Dispatch::Arm &dispatch(const Dispatch &cases, aint value) {
+    auto kind = kindOf(value);
+    if (kind == Kind::SEXP || kind == Kind::ARRAY) {
+        if (auto *arm = findArm(cases, value, kind)) {
+            return *arm;
+        }
+    }
+    return cases.kinds[static_cast<int>(kind)];
+}
+
+// Whether a kind pattern passes for a value of the given kind
+inline bool kindPasses(Op patt, Kind kind) {
+    switch (patt) {
+        case Op::PATT_STR_TAG:
+            return kind == Kind::STRING;
+        case Op::PATT_ARRAY:
+            return kind == Kind::ARRAY;
+        case Op::PATT_SEXP:
+            return kind == Kind::SEXP;
+        case Op::PATT_BOXED:
+            return kind != Kind::UNBOXED;
+        case Op::PATT_UNBOXED:
+            return kind == Kind::UNBOXED;
+        case Op::PATT_CLOSURE:
+            return kind == Kind::CLOSURE;
+        default:
+            return false;
+    }
+}
+
+constexpr static int UNPACK_MAX_NODES = 16;
+
+// Pattern of a case-of branch compiled into an UNPACK (see patterns.h). Its nodes are the values it looks at: the
+// scrutinee first, then fields of the nodes before them, each with the test it must pass. The values the branch names
+// are bound to their locations once all tests pass.
+struct Unpack {
+    struct Node {
+        int parent = -1; // node this one is a field of, -1 for the scrutinee
+        int field = 0;
+        Op test = Op::NOP; // TAG, ARRAY, CONST, a kind pattern, or NOP for none
+        auint tag = 0; // for TAG, the unboxed hash
+        int value = 0; // for TAG and ARRAY the arity, for CONST the constant
+    };
+    std::vector<Node> nodes;
+    std::vector<std::pair<int, Loc>> bindings;
+    struct Decoded *body = nullptr; // continues at with both copies of the scrutinee dropped when the pattern matches
+    struct Decoded *fail = nullptr; // continues at with the stack unchanged otherwise
+};
+
+struct Decoded {
+    const void *handler = nullptr; // label of the handler, bound when the code is run
+    Op op = Op::NOP;
+    unsigned char opcode = 0; // original opcode, for failure reports
+    Kind quick = Kind::UNSEEN;
+    int a = 0, b = 0; // for CALL and TAIL_CALL, `b` is 1 if a closure is passed below the arguments
+    int c = 0; // filled by the load-time passes, for BEGIN the number of captures the function reads
+    int depth = -1; // for BEGIN of verified code, the maximum operand stack depth of the function
+    int jump = -1; // bytecode offset of the jump, call or closure target
+    union {
+        Decoded *target = nullptr;
+        char *str;
+        const Loc *locs;
+        InlineCache *calls;
+        const Dispatch *cases;
+        const Unpack *pattern;
+    };
+    char *ip = nullptr; // instruction pointer the original handler would observe, for failure reports
+    aint cache = 0; // value computed once by a quickened instruction, for SEXP and TAG the interned hash of the tag,
+                    // for STRING the shared literal
+    const void *native = nullptr; // machine code of the instruction, when compiled by the JIT
+};
+
+struct ThreadedCode {
+    bytefile *bf = nullptr;
+    std::vector<Decoded> insns;
+    std::vector<Decoded *> entries; // bytecode offset -> decoded instruction starting there
+    std::deque<Loc> captures;
+    std::deque<InlineCache> calls;
+    std::deque<Dispatch> dispatches;
+    std::deque<Unpack> patterns;
+    std::map<const char *, std::unique_ptr<aint[]>> literals; // string operand -> string object outside of the heap
+    Decoded *(*enter)(const void *native) = nullptr; // runs native code until it leaves the compiled functions
+
+    // Builds the string object of a literal once, in memory the GC neither scans nor moves. Returns 0 for an operand
+    // that is not terminated in the string table.
+    aint literal(char *str) {
+        auto &object = literals[str];
+        if (object == nullptr) {
+            auto pos = str - bf->string_ptr;
+            if (pos < 0 || pos >= bf->stringtab_size || std::memchr(str, 0, bf->stringtab_size - pos) == nullptr) {
+                return 0;
+            }
+            auto len = std::strlen(str);
+            object.reset(new aint[BYTES_TO_WORDS(DATA_HEADER_SZ + len + 1)]());
+            auto *d = reinterpret_cast<data *>(object.get());
+            d->data_header = len << 3 | STRING_TAG;
+            std::memcpy(d->contents, str, len + 1);
+        }
+        return reinterpret_cast<aint>(reinterpret_cast<data *>(object.get())->contents);
+    }
+
+    Decoded *entry(aint offset) const {
+        if (offset < 0 || offset > bf->code_size || entries[offset] == nullptr) {
+            return nullptr;
+        }
+        return entries[offset];
+    }
+};
+
+struct ThreadedDecoder {
+    std::deque<Loc> &captures;
+    Decoded insn;
+    bool falls = true;
+    bool jumps = false;
+
+    explicit ThreadedDecoder(std::deque<Loc> &captures) : captures(captures) {
+    }
+
+    void emit(ProcessorState &state, Op op, int a = 0, int b = 0) {
+        insn.op = op;
+        insn.a = a;
+        insn.b = b;
+        insn.ip = state.ip;
+    }
+
+    void jumpTo(int addr) {
+        insn.jump = addr;
+        jumps = true;
+    }
+
+    template<typename T>
+    static Op shift(Op base, T variant) {
+        return static_cast<Op>(static_cast<int>(base) + static_cast<int>(variant));
+    }
+
+    void processBinop(ProcessorState &state, BinOp op) {
+        if (static_cast<int>(op) < 0 || op > BinOp::OR) {
+            emit(state, Op::NOP); // the switch engine ignores unknown operators as well
+            return;
+        }
+        emit(state, shift(Op::ADD, op));
+    }
+
+    void processConst(ProcessorState &state, int cnst) { emit(state, Op::CONST, cnst); }
+    void processString(ProcessorState &state, char *str) { emit(state, Op::STRING); insn.str = str; }
+    void processSexp(ProcessorState &state, char *tag, int n) { emit(state, Op::SEXP, n); insn.str = tag; }
+    void processSti(ProcessorState &state) { emit(state, Op::STI); }
+    void processSta(ProcessorState &state) { emit(state, Op::STA); }
+    void processJmp(ProcessorState &state, int addr) { emit(state, Op::JMP); jumpTo(addr); falls = false; }
+    void processEnd(ProcessorState &state) { emit(state, Op::END); falls = false; }
+    void processRet(ProcessorState &state) { emit(state, Op::RET); }
+    void processDrop(ProcessorState &state) { emit(state, Op::DROP); }
+    void processDup(ProcessorState &state) { emit(state, Op::DUP); }
+    void processSwap(ProcessorState &state) { emit(state, Op::SWAP); }
+    void processElem(ProcessorState &state) { emit(state, Op::ELEM); }
+
+    void processLd(ProcessorState &state, const Loc &loc) { emit(state, shift(Op::LD_G, loc.type), loc.value); }
+    void processLda(ProcessorState &state, const Loc &loc) { emit(state, Op::LDA, loc.value); }
+    void processSt(ProcessorState &state, const Loc &loc) { emit(state, shift(Op::ST_G, loc.type), loc.value); }
+
+    void processCJmp(ProcessorState &state, aint addr, bool isNz) {
+        emit(state, isNz ? Op::CJMPNZ : Op::CJMPZ);
+        jumpTo(static_cast<int>(addr));
+    }
+
+    void processBegin(ProcessorState &state, int nargs, int nlocals) { emit(state, Op::BEGIN, nargs, nlocals); }
+
+    void processClosure(ProcessorState &state, int n, int addr) {
+        emit(state, Op::CLOSURE, n, addr);
+        jumpTo(addr);
+        auto start = captures.size();
+        for (int i = 0; i < n; i++) {
+            char locType = state.readByte();
+            captures.push_back(state.readLoc(locType));
+        }
+        insn.locs = n > 0 ? &captures[start] : nullptr;
+    }
+
+    void processCallC(ProcessorState &state, int nargs) { emit(state, Op::CALLC, nargs); }
+
+    void processCall(ProcessorState &state, size_t addr, int nargs) {
+        emit(state, Op::CALL, nargs);
+        jumpTo(static_cast<int>(addr));
+    }
+
+    void processTag(ProcessorState &state, char *tag, int len) { emit(state, Op::TAG, len); insn.str = tag; }
+    void processArray(ProcessorState &state, int n) { emit(state, Op::ARRAY, n); }
+    void processFail(ProcessorState &state, int l, int c) { emit(state, Op::FAIL, l, c); falls = false; }
+    void processLine(ProcessorState &state, int) { emit(state, Op::NOP); }
+
+    void processPatt(ProcessorState &state, int patt) {
+        if (patt > static_cast<int>(Patts::CLOSURE)) {
+            emit(state, Op::PATT, patt);
+            return;
+        }
+        emit(state, shift(Op::PATT_STR, patt));
+    }
+
+    void processLread(ProcessorState &state) { emit(state, Op::LREAD); }
+    void processLwrite(ProcessorState &state) { emit(state, Op::LWRITE); }
+    void processLlength(ProcessorState &state) { emit(state, Op::LLENGTH); }
+    void processLstring(ProcessorState &state) { emit(state, Op::LSTRING); }
+    void processBarray(ProcessorState &state, int n) { emit(state, Op::BARRAY, n); }
+};
+
+// Translates the code reachable from the public symbols into threaded code. Instructions are laid out in the
+// bytecode order, so that the fall-through successor of a decoded instruction is always the next one. LINE and
+// STOP are dropped, and the end of the code becomes a HALT instruction.
+inline ThreadedCode decodeThreaded(bytefile *bf) {
+    ThreadedCode code;
+    code.bf = bf;
+
+    std::map<int, std::pair<Decoded, int>> decoded; // offset -> (instruction, offset of the next one)
+    std::vector<int> worklist;
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        worklist.push_back(get_public_offset(bf, i));
+    }
+
+    ProcessorState state = {bf, nullptr};
+    while (!worklist.empty()) {
+        auto offset = worklist.back();
+        worklist.pop_back();
+        if (offset == bf->code_size || decoded.contains(offset)) {
+            continue;
+        }
+        if (offset < 0 || offset > bf->code_size) {
+            state.fail("Jump target %.8x is out of bounds for [0, %.8x]", offset, bf->code_size);
+        }
+
+        state.ip = bf->code_ptr + offset;
+        ThreadedDecoder decoder{code.captures};
+        processInstruction(decoder, state);
+        decoder.insn.opcode = bf->code_ptr[offset];
+
+        auto next = static_cast<int>(state.ip - bf->code_ptr);
+        if (decoder.falls) {
+            worklist.push_back(next);
+        }
+        if (decoder.jumps) {
+            worklist.push_back(decoder.insn.jump);
+        }
+        decoded.emplace(offset, std::make_pair(decoder.insn, next));
+    }
+
+    std::vector<int> index(bf->code_size + 1, -1);
+    std::vector<int> elided;
+    code.insns.reserve(decoded.size() + 1);
+    int end = 0;
+    for (auto &[offset, entry]: decoded) {
+        auto &[insn, next] = entry;
+        if (offset < end) {
+            state.fail("Instruction at %.8x overlaps with the previous one", offset);
+        }
+        end = next;
+
+        elided.push_back(offset);
+        if (insn.op == Op::NOP) {
+            continue;
+        }
+        for (auto o: elided) {
+            index[o] = static_cast<int>(code.insns.size());
+        }
+        elided.clear();
+        code.insns.push_back(insn);
+    }
+
+    elided.push_back(static_cast<int>(bf->code_size));
+    for (auto o: elided) {
+        index[o] = static_cast<int>(code.insns.size());
+    }
+    Decoded halt;
+    halt.op = Op::HALT;
+    halt.ip = bf->code_ptr + bf->code_size;
+    code.insns.push_back(halt);
+
+    code.entries.assign(bf->code_size + 1, nullptr);
+    for (int o = 0; o <= bf->code_size; o++) {
+        if (index[o] >= 0) {
+            code.entries[o] = &code.insns[index[o]];
+        }
+    }
+    for (auto &insn: code.insns) {
+        switch (insn.op) {
+            case Op::JMP:
+            case Op::CJMPZ:
+            case Op::CJMPNZ:
+            case Op::CALL:
+                insn.target = code.entries[insn.jump];
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < code.insns.size(); i++) {
+        auto &insn = code.insns[i];
+        if (insn.op == Op::SEXP || insn.op == Op::TAG) {
+            insn.cache = internTag(insn.str);
+        } else if (insn.op == Op::CALLC || insn.op == Op::TAIL_CALLC) {
+            insn.calls = &code.calls.emplace_back();
+        } else if (insn.op == Op::STRING) {
+            // Strings are mutable, so only a literal that is just compared to, right away or after loading the
+            // value it is compared with, can share a single object
+            auto isLoad = [](Op op) { return op >= Op::LD_G && op <= Op::LD_C; };
+            auto *next = &insn + 1;
+            if (next->op == Op::PATT_STR || (isLoad(next->op) && next[1].op == Op::PATT_STR)) {
+                insn.cache = code.literal(insn.str);
+            }
+        }
+    }
+
+    // Calls whose result is returned right away, possibly through jumps, replace the frame of the caller
+    for (size_t i = 0; i + 1 < code.insns.size(); i++) {
+        auto &insn = code.insns[i];
+        if (insn.op != Op::CALL && insn.op != Op::CALLC) {
+            continue;
+        }
+        auto *next = &insn + 1;
+        for (int hops = 0; next->op == Op::JMP && next->target != nullptr && hops < 16; hops++) {
+            next = next->target;
+        }
+        if (next->op == Op::END) {
+            insn.op = insn.op == Op::CALL ? Op::TAIL_CALL : Op::TAIL_CALLC;
+        }
+    }
+
+    return code;
+}
+
+// Quickening: ELEM, STA, TAG, ARRAY and the kind patterns record the kind of the first receiver they get in the
+// decoded instruction, and from then on handle receivers of that kind inline, without calling into the runtime. The
+// guard falls back to the generic runtime function, which stays in use if the kind at the site changes.
+
+inline bool observe(Decoded *pc, Kind kind) {
+    if (pc->quick == Kind::UNSEEN) {
+        pc->quick = kind;
+    } else if (pc->quick != kind) {
+        pc->quick = Kind::GENERIC;
+    }
+    return pc->quick == kind;
+}
+
+template<bool Checked>
+inline void quickElem(Interpreter<Checked> &interp, ProcessorState &state, Decoded *pc) {
+    auto ind = interp.vstack_pop();
+    auto src = interp.vstack_pop();
+    if (UNBOXED(ind) && !UNBOXED(src)) {
+        auto i = UNBOX(ind);
+        auto *d = TO_DATA(src);
+        if (pc->quick == Kind::SEXP && TAG(d->data_header) == SEXP_TAG) {
+            interp.vstack_push(reinterpret_cast<aint *>(TO_SEXP(src)->contents)[i]);
+            return;
+        }
+        if (pc->quick == Kind::ARRAY && TAG(d->data_header) == ARRAY_TAG) {
+            interp.vstack_push(reinterpret_cast<aint *>(d->contents)[i]);
+            return;
+        }
+        if (pc->quick == Kind::STRING && TAG(d->data_header) == STRING_TAG) {
+            interp.vstack_push(BOX(d->contents[i]));
+            return;
+        }
+        observe(pc, kindOf(src));
+    }
+    interp.vstack_push(src);
+    interp.vstack_push(ind);
+    interp.processElem(state);
+}
+
+template<bool Checked>
+inline void quickSta(Interpreter<Checked> &interp, ProcessorState &state, Decoded *pc) {
+    auto val = interp.vstack_pop();
+    auto ind = interp.vstack_pop();
+    auto dst = interp.vstack_pop();
+    if (UNBOXED(ind) && !UNBOXED(dst)) {
+        auto i = UNBOX(ind);
+        auto *d = TO_DATA(dst);
+        if (pc->quick == Kind::ARRAY && TAG(d->data_header) == ARRAY_TAG) {
+            reinterpret_cast<aint *>(d->contents)[i] = val;
+            interp.vstack_push(val);
+            return;
+        }
+        if (pc->quick == Kind::SEXP && TAG(d->data_header) == SEXP_TAG) {
+            reinterpret_cast<aint *>(TO_SEXP(dst)->contents)[i] = val;
+            interp.vstack_push(val);
+            return;
+        }
+        observe(pc, kindOf(dst));
+    }
+    interp.vstack_push(dst);
+    interp.vstack_push(ind);
+    interp.vstack_push(val);
+    interp.processSta(state);
+}
+
+// The hash of the tag is interned at load time. An invalid tag fails in the runtime before any specialization.
+template<bool Checked>
+inline void quickTag(Interpreter<Checked> &interp, ProcessorState &state, Decoded *pc) {
+    auto value = interp.vstack_pop();
+    if (!UNBOXED(value)) {
+        auto *d = TO_DATA(value);
+        if (pc->quick == Kind::SEXP && TAG(d->data_header) == SEXP_TAG) {
+            interp.vstack_push(BOX(TO_SEXP(value)->tag == static_cast<auint>(UNBOX(pc->cache)) &&
+                                   LEN(d->data_header) == static_cast<auint>(pc->a)));
+            return;
+        }
+    }
+    if (pc->quick != Kind::GENERIC) {
+        observe(pc, kindOf(value));
+    }
+    interp.vstack_push(value);
+    interp.processTag(state, pc->str, pc->a, pc->cache);
+}
+
+template<bool Checked>
+inline void quickArray(Interpreter<Checked> &interp, ProcessorState &state, Decoded *pc) {
+    auto value = interp.vstack_pop();
+    if (!UNBOXED(value)) {
+        auto *d = TO_DATA(value);
+        if (pc->quick == Kind::ARRAY && TAG(d->data_header) == ARRAY_TAG) {
+            interp.vstack_push(BOX(LEN(d->data_header) == static_cast<auint>(pc->a)));
+            return;
+        }
+    }
+    if (pc->quick != Kind::GENERIC) {
+        observe(pc, kindOf(value));
+    }
+    interp.vstack_push(value);
+    interp.processArray(state, pc->a);
+}
+
+// The outcome of a kind pattern only depends on the kind of the value, so it is recorded along with the kind
+template<Op op, bool Checked>
+inline void quickPatt(Interpreter<Checked> &interp, ProcessorState &state, Decoded *pc) {
+    auto value = interp.vstack_pop();
+    auto kind = kindOf(value);
+    if (pc->quick == kind) {
+        interp.vstack_push(pc->cache);
+        return;
+    }
+    interp.vstack_push(value);
+    interp.processPatt(state, static_cast<int>(op) - static_cast<int>(Op::PATT_STR));
+    if (pc->quick != Kind::GENERIC && observe(pc, kind)) {
+        pc->cache = *SP;
+    }
+}
+
+// Binary operator on two boxed integers, without unboxing them: both carry the same tag bit, which sums and differences
+// cancel out and comparisons ignore. The arithmetic wraps around as the one on the unboxed values does.
+template<Op op>
+[[gnu::always_inline]] inline aint applyIntBinop(aint lhs, aint rhs) {
+    auto l = static_cast<auint>(lhs), r = static_cast<auint>(rhs);
+    if constexpr (op == Op::ADD_INT) {
+        return static_cast<aint>(l + r - 1);
+    } else if constexpr (op == Op::SUB_INT) {
+        return static_cast<aint>(l - r + 1);
+    } else if constexpr (op == Op::MUL_INT) {
+        return static_cast<aint>((l - 1) * static_cast<auint>(UNBOX(rhs)) + 1);
+    } else if constexpr (op == Op::LT_INT) {
+        return BOX(lhs < rhs);
+    } else if constexpr (op == Op::LTQ_INT) {
+        return BOX(lhs <= rhs);
+    } else if constexpr (op == Op::GT_INT) {
+        return BOX(lhs > rhs);
+    } else if constexpr (op == Op::GTQ_INT) {
+        return BOX(lhs >= rhs);
+    } else if constexpr (op == Op::EQ_INT) {
+        return BOX(lhs == rhs);
+    } else {
+        static_assert(op == Op::NEQ_INT, "not a binary operator on integers");
+        return BOX(lhs != rhs);
+    }
+}
+
+template<bool Checked>
+struct Tracer;
+
+// Effect of a straight-line operation, shared by its own handler and by the superinstructions starting with it
+template<Op op, bool Checked>
+[[gnu::always_inline]] inline void perform(Interpreter<Checked> &interp, ProcessorState &state, bytefile *bf,
+                                           Decoded *pc) {
+    if constexpr (op == Op::NOP) {
+    } else if constexpr (op >= Op::ADD && op <= Op::OR) {
+        interp.processBinop(state, static_cast<BinOp>(static_cast<int>(op) - static_cast<int>(Op::ADD)));
+    } else if constexpr (op == Op::CONST) {
+        interp.processConst(state, pc->a);
+    } else if constexpr (op == Op::STRING) {
+        if (pc->cache != 0) {
+            interp.vstack_push(pc->cache);
+        } else {
+            interp.processString(state, pc->str);
+        }
+    } else if constexpr (op == Op::SEXP) {
+        interp.processSexp(state, pc->str, pc->a, pc->cache);
+    } else if constexpr (op == Op::STI) {
+        interp.processSti(state);
+    } else if constexpr (op == Op::STA) {
+        quickSta(interp, state, pc);
+    } else if constexpr (op == Op::RET) {
+        interp.processRet(state);
+    } else if constexpr (op == Op::DROP) {
+        interp.processDrop(state);
+    } else if constexpr (op == Op::DUP) {
+        interp.processDup(state);
+    } else if constexpr (op == Op::SWAP) {
+        interp.processSwap(state);
+    } else if constexpr (op == Op::ELEM) {
+        quickElem(interp, state, pc);
+    } else if constexpr (op == Op::LD_G) {
+        interp.vstack_push(*interp.global(bf, pc->a));
+    } else if constexpr (op == Op::LD_L) {
+        interp.vstack_push(*interp.local(pc->a));
+    } else if constexpr (op == Op::LD_A) {
+        interp.vstack_push(*interp.arg(pc->a));
+    } else if constexpr (op == Op::LD_C) {
+        interp.vstack_push(*interp.closure(pc->a));
+    } else if constexpr (op == Op::LDA) {
+        interp.processLda(state, Loc(Loc::Type::G, pc->a));
+    } else if constexpr (op >= Op::ST_G && op <= Op::ST_C) {
+        interp.processSt(state, Loc(static_cast<Loc::Type>(static_cast<int>(op) - static_cast<int>(Op::ST_G)), pc->a));
+    } else if constexpr (op == Op::BEGIN) {
+        interp.processBegin(state, pc->a, pc->b, pc->depth);
+    } else if constexpr (op == Op::CLOSURE) {
+        for (int i = 0; i < pc->a; i++) {
+            interp.vstack_push(interp.load(state, pc->locs[i]));
+        }
+        interp.pushClosure(pc->a, pc->b);
+    } else if constexpr (op == Op::TAG) {
+        quickTag(interp, state, pc);
+    } else if constexpr (op == Op::ARRAY) {
+        quickArray(interp, state, pc);
+    } else if constexpr (op == Op::FAIL) {
+        interp.processFail(state, pc->a, pc->b);
+    } else if constexpr (op == Op::PATT_STR) {
+        interp.processPatt(state, static_cast<int>(Patts::STR));
+    } else if constexpr (op >= Op::PATT_STR_TAG && op <= Op::PATT_CLOSURE) {
+        quickPatt<op>(interp, state, pc);
+    } else if constexpr (op == Op::PATT) {
+        interp.processPatt(state, pc->a);
+    } else if constexpr (op == Op::LREAD) {
+        interp.processLread(state);
+    } else if constexpr (op == Op::LWRITE) {
+        interp.processLwrite(state);
+    } else if constexpr (op == Op::LLENGTH) {
+        interp.processLlength(state);
+    } else if constexpr (op == Op::LSTRING) {
+        interp.processLstring(state);
+    } else if constexpr (op == Op::BARRAY) {
+        interp.processBarray(state, pc->a);
+    } else if constexpr (op >= Op::ADD_INT && op <= Op::NEQ_INT) {
+        auto rhs = interp.vstack_pop();
+        auto lhs = interp.vstack_pop();
+        interp.vstack_push(applyIntBinop<op>(lhs, rhs));
+    } else {
+        static_assert(op == Op::NOP, "not a straight-line operation");
+    }
+}
+
+// Stack pointer and frame of the running function, which the threaded loop keeps in locals while running verified
+// code, so that they stay in machine registers. They are written back to the interpreter (`__gc_stack_top`) before
+// anything else may look at it: every operation that is not run on the registers, a call into the runtime, native
+// code and the tracer.
+struct Registers {
+    aint *sp = nullptr; // the top of the operand stack, as SP
+    aint *locals = nullptr; // local 0
+    aint *args = nullptr; // argument 0, with the following ones below it
+    aint *globals = nullptr;
+
+    template<bool Checked>
+    [[gnu::always_inline]] void load(const Interpreter<Checked> &interp, bool frame) {
+        sp = SP;
+        if (frame && interp.fp != nullptr) {
+            locals = interp.fp - interp.frame_nlocals;
+            args = interp.fp + FRAME_WORDS + interp.frame_nargs - 1;
+        }
+    }
+
+    [[gnu::always_inline]] void save() const {
+        __gc_stack_top = sp - 1;
+    }
+};
+
+// Whether verified code runs an operation on the registers alone: it only moves values between the operand stack and
+// the frame, and can not fail once the verifier has proven the stack and the locations it uses to be in bounds
+constexpr bool isRegisterOp(Op op) {
+    switch (op) {
+        case Op::NOP:
+        case Op::ADD: case Op::SUB: case Op::MUL: case Op::LT: case Op::LTQ: case Op::GT: case Op::GTQ: case Op::EQ:
+        case Op::NEQ: case Op::AND: case Op::OR:
+        case Op::CONST: case Op::DROP: case Op::DUP:
+        case Op::LD_G: case Op::LD_L: case Op::LD_A: case Op::ST_G: case Op::ST_L: case Op::ST_A:
+        case Op::ADD_INT: case Op::SUB_INT: case Op::MUL_INT: case Op::LT_INT: case Op::LTQ_INT: case Op::GT_INT:
+        case Op::GTQ_INT: case Op::EQ_INT: case Op::NEQ_INT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+template<Op op>
+[[gnu::always_inline]] inline aint applyBinop(aint lhs, aint rhs) {
+    if constexpr (op == Op::ADD) {
+        return lhs + rhs;
+    } else if constexpr (op == Op::SUB) {
+        return lhs - rhs;
+    } else if constexpr (op == Op::MUL) {
+        return lhs * rhs;
+    } else if constexpr (op == Op::LT) {
+        return lhs < rhs;
+    } else if constexpr (op == Op::LTQ) {
+        return lhs <= rhs;
+    } else if constexpr (op == Op::GT) {
+        return lhs > rhs;
+    } else if constexpr (op == Op::GTQ) {
+        return lhs >= rhs;
+    } else if constexpr (op == Op::EQ) {
+        return lhs == rhs;
+    } else if constexpr (op == Op::NEQ) {
+        return lhs != rhs;
+    } else if constexpr (op == Op::AND) {
+        return lhs && rhs;
+    } else {
+        static_assert(op == Op::OR, "not a binary operator that can not fail");
+        return lhs || rhs;
+    }
+}
+
+// Effect of an operation for which `isRegisterOp` holds, the same as the one `perform` has on the interpreter
+template<Op op>
+[[gnu::always_inline]] inline void performOnRegisters(Registers &regs, const Decoded *pc) {
+    auto *&sp = regs.sp;
+    if constexpr (op == Op::NOP) {
+    } else if constexpr (op >= Op::ADD && op <= Op::OR) {
+        auto rhs = UNBOX(*sp++);
+        *sp = BOX(applyBinop<op>(UNBOX(*sp), rhs));
+    } else if constexpr (op >= Op::ADD_INT && op <= Op::NEQ_INT) {
+        auto rhs = *sp++;
+        *sp = applyIntBinop<op>(*sp, rhs);
+    } else if constexpr (op == Op::CONST) {
+        *--sp = BOX(pc->a);
+    } else if constexpr (op == Op::DROP) {
+        ++sp;
+    } else if constexpr (op == Op::DUP) {
+        --sp;
+        sp[0] = sp[1];
+    } else if constexpr (op == Op::LD_G) {
+        *--sp = regs.globals[pc->a];
+    } else if constexpr (op == Op::LD_L) {
+        *--sp = regs.locals[pc->a];
+    } else if constexpr (op == Op::LD_A) {
+        *--sp = regs.args[-pc->a];
+    } else if constexpr (op == Op::ST_G) {
+        regs.globals[pc->a] = *sp;
+    } else if constexpr (op == Op::ST_L) {
+        regs.locals[pc->a] = *sp;
+    } else if constexpr (op == Op::ST_A) {
+        regs.args[-pc->a] = *sp;
+    } else {
+        static_assert(op == Op::NOP, "not an operation on the registers");
+    }
+}
+
+// Returns the instruction the closure below the arguments of the call site `pc` starts with. Targets already seen
+// at the site are taken from its inline cache, skipping the lookup and the checks of the entry instruction. The
+// verifier can not tell what a closure call calls, so the called value is checked in checked and unchecked code alike.
+template<bool Checked>
+inline Decoded *closureEntry(ThreadedCode &code, Interpreter<Checked> &interp, Decoded *pc) {
+    auto &state = interp.state;
+    auto nargs = pc->a;
+    interp.verify_vstack(SP + nargs, ".callC");
+    auto closureLoc = SP + nargs;
+    if (UNBOXED(*closureLoc) || TAG(TO_DATA(*closureLoc)->data_header) != CLOSURE_TAG) {
+        state.fail("Called value is not a closure");
+    }
+    auto target = reinterpret_cast<aint *>(*closureLoc)[0];
+    auto &cache = *pc->calls;
+    for (int i = 0; i < cache.size; i++) {
+        if (cache.targets[i] == target) {
+            auto *entry = cache.entries[i];
+            if (static_cast<int>(LEN(TO_DATA(*closureLoc)->data_header)) - 1 < entry->c) {
+                state.fail("Closure at %.8lx does not accept %d arguments", get_original_offset(code.bf, target),
+                           nargs);
+            }
+            return entry;
+        }
+    }
+    auto *entry = code.entry(target);
+    if (entry == nullptr) {
+        state.fail("Closure target %.8lx is not an instruction", get_original_offset(code.bf, target));
+    }
+    auto ncaptures = static_cast<int>(LEN(TO_DATA(*closureLoc)->data_header)) - 1;
+    if (entry->op != Op::BEGIN || entry->a != nargs || ncaptures < entry->c) {
+        state.fail("Closure at %.8lx does not accept %d arguments", get_original_offset(code.bf, target), nargs);
+    }
+    if (cache.size < INLINE_CACHE_SIZE) {
+        cache.targets[cache.size] = target;
+        cache.entries[cache.size++] = entry;
+    }
+    return entry;
+}
+
+// Returns the arm of the SWITCH `pc` the scrutinee on top of the stack continues at. The scrutinee stays on the stack,
+// as it does after a probe that succeeds, duplicated if the probe leaves it twice.
+template<bool Checked>
+inline Decoded *selectCase(Interpreter<Checked> &interp, Decoded *pc) {
+    interp.verify_vstack(SP, ".switch");
+    auto &arm = dispatch(*pc->cases, *SP);
+    if (arm.dup) {
+        interp.vstack_push(*SP);
+    }
+    return arm.target;
+}
+
+inline bool nodePasses(const Unpack::Node &node, aint value) {
+    switch (node.test) {
+        case Op::NOP:
+            return true;
+        case Op::CONST:
+            return UNBOX(value) == node.value;
+        case Op::TAG:
+            return !UNBOXED(value) && TAG(TO_DATA(value)->data_header) == SEXP_TAG && TO_SEXP(value)->tag == node.tag &&
+                   LEN(TO_DATA(value)->data_header) == static_cast<auint>(node.value);
+        case Op::ARRAY:
+            return !UNBOXED(value) && TAG(TO_DATA(value)->data_header) == ARRAY_TAG &&
+                   LEN(TO_DATA(value)->data_header) == static_cast<auint>(node.value);
+        default:
+            return kindPasses(node.test, kindOf(value));
+    }
+}
+
+// Matches the scrutinee, on the stack twice, against the pattern of the UNPACK `pc` and returns the instruction to
+// continue at. Fields are only read from values whose tests have passed, so they always exist.
+template<bool Checked>
+inline Decoded *unpack(Interpreter<Checked> &interp, Decoded *pc) {
+    auto &pattern = *pc->pattern;
+    interp.verify_vstack(SP + 1, ".unpack");
+    aint values[UNPACK_MAX_NODES];
+    for (size_t i = 0; i < pattern.nodes.size(); i++) {
+        auto &node = pattern.nodes[i];
+        auto value = *SP;
+        if (node.parent >= 0) {
+            auto parent = values[node.parent];
+            value = pattern.nodes[node.parent].test == Op::TAG
+                        ? reinterpret_cast<aint *>(TO_SEXP(parent)->contents)[node.field]
+                        : reinterpret_cast<aint *>(TO_DATA(parent)->contents)[node.field];
+        }
+        if (!nodePasses(node, value)) {
+            return pattern.fail;
+        }
+        values[i] = value;
+    }
+    for (auto &[node, loc]: pattern.bindings) {
+        switch (loc.type) {
+            case Loc::Type::G:
+                *interp.global(interp.state.bf, loc.value) = values[node];
+                break;
+            case Loc::Type::L:
+                *interp.local(loc.value) = values[node];
+                break;
+            case Loc::Type::A:
+                *interp.arg(loc.value) = values[node];
+                break;
+            case Loc::Type::C:
+                *interp.closure(loc.value) = values[node];
+                break;
+        }
+    }
+    interp.vstack_pop();
+    interp.vstack_pop();
+    return pattern.body;
+}
+
+// Replaces the frame of the caller with the one of a closure call and returns the instruction the closure starts with
+template<bool Checked>
+inline Decoded *tailClosure(ThreadedCode &code, Interpreter<Checked> &interp, Decoded *pc) {
+    auto *entry = closureEntry(code, interp, pc);
+    interp.tailCall(pc->a, true);
+    return entry;
+}
+
+// Pushes the frame of a closure call and returns the instruction the closure starts with
+template<bool Checked>
+inline Decoded *enterClosure(ThreadedCode &code, Interpreter<Checked> &interp, Decoded *pc) {
+    auto *entry = closureEntry(code, interp, pc);
+    interp.call(reinterpret_cast<aint>(pc + 1), true);
+    return entry;
+}
+
+// Runs the threaded code with direct-threaded dispatch: every handler jumps straight to the handler of the
+// next instruction. The semantics of the instructions are the ones of `Interpreter`, only the control flow is
+// handled here, with return addresses on the call stack being pointers to the decoded instructions.
+// Unchecked code must have passed the verifier, which leaves only the closure calls to be checked at run time.
+// It also keeps the stack pointer and the frame in `Registers`: loads, stores, constants and arithmetic run on them
+// directly, and the instruction pointer of the original handler is only stored for the instructions that may fail.
+//
+// An instruction followed by one forming a superinstruction with it (see superinstructions.h, generated from a
+// profile at build time) runs both in a single handler: the second one keeps its own handler, so that it can
+// still be reached by jumps, but the first one continues to it without going through the dispatch.
+//
+// Instructions of functions compiled by the JIT and heads of traces enter the native code, which runs until control
+// reaches an instruction that is not compiled. With a tracer, the heads it watches are dispatched to it first.
+template<bool Checked>
+void runThreaded(ThreadedCode &code, Interpreter<Checked> &interp, Tracer<Checked> *tracer = nullptr) {
+    static const void *labels[] = {
+#define OP_LABEL(name) &&op_##name,
+        THREADED_OPS(OP_LABEL)
+#undef OP_LABEL
+    };
+    static const std::tuple<Op, Op, const void *> supers[] = {
+#define SUPER_LABEL(first, second) {Op::first, Op::second, &&op_##first##__##second},
+        SUPERINSTRUCTIONS(SUPER_LABEL)
+#undef SUPER_LABEL
+        {Op::COUNT, Op::COUNT, nullptr}
+    };
+
+    constexpr auto count = static_cast<int>(Op::COUNT);
+    std::vector<const void *> fused(count * count, nullptr);
+    for (auto &[first, second, label]: supers) {
+        if (first != Op::COUNT) {
+            fused[static_cast<int>(first) * count + static_cast<int>(second)] = label;
+        }
+    }
+    for (size_t i = 0; i < code.insns.size(); i++) {
+        auto &insn = code.insns[i];
+        insn.handler = labels[static_cast<int>(insn.op)];
+        if (i + 1 < code.insns.size()) {
+            if (auto *label = fused[static_cast<int>(insn.op) * count + static_cast<int>(code.insns[i + 1].op)]) {
+                insn.handler = label;
+            }
+        }
+        if (insn.native != nullptr) {
+            insn.handler = &&op_NATIVE;
+        }
+    }
+    if (tracer != nullptr) {
+        tracer->attach(&&op_COUNT, &&op_NATIVE);
+    }
+
+    auto &state = interp.state;
+    auto *bf = code.bf;
+    Decoded *pc = code.entry(bf->entrypoint_ptr - bf->code_ptr);
+
+    interp.call(reinterpret_cast<aint>(code.entry(bf->code_size)), false);
+
+    Registers regs;
+    regs.globals = __gc_stack_bottom - bf->global_area_size;
+    regs.load(interp, true);
+
+    // Only what may fail needs the instruction pointer of the original handler. SAVE() writes the registers back to
+    // the interpreter and LOAD() reads them again around the sync points:
+    // - every instruction not run on the registers, which includes every call into the runtime;
+    // - entering native code;
+    // - entering the tracer, from the counting handler.
+    // The frame is only read again after BEGIN, END, native code and the tracer, the only ones that move it.
+#define SYNC()                        \
+    do {                              \
+        state.ip = pc->ip;            \
+        state.opcode = pc->opcode;    \
+    } while (0)
+#define SAVE()                        \
+    do {                              \
+        if constexpr (!Checked) {     \
+            regs.save();              \
+        }                             \
+    } while (0)
+#define LOAD(frame)                   \
+    do {                              \
+        if constexpr (!Checked) {     \
+            regs.load(interp, frame); \
+        }                             \
+    } while (0)
+#define DISPATCH() \
+    do {           \
+        DEBUG("0x%.8lx:\t%d\n", pc->ip - bf->code_ptr, pc->opcode); \
+        goto *pc->handler; \
+    } while (0)
+#define NEXT() \
+    do {       \
+        ++pc;  \
+        DISPATCH(); \
+    } while (0)
+#define STEP(name)                                           \
+    do {                                                     \
+        if constexpr (!Checked && isRegisterOp(Op::name)) {  \
+            performOnRegisters<Op::name>(regs, pc);          \
+        } else {                                             \
+            SAVE();                                          \
+            SYNC();                                          \
+            perform<Op::name>(interp, state, bf, pc);        \
+            LOAD(Op::name == Op::BEGIN);                     \
+        }                                                    \
+    } while (0)
+#define HANDLER(name) \
+    op_##name: {      \
+        STEP(name);   \
+        NEXT();       \
+    }
+#define SUPER_HANDLER(first, second) \
+    op_##first##__##second: {        \
+        STEP(first);                 \
+        ++pc;                        \
+        goto op_##second;            \
+    }
+
+    DISPATCH();
+
+    STRAIGHT_OPS(HANDLER)
+    SUPERINSTRUCTIONS(SUPER_HANDLER)
+
+op_HALT:
+    SAVE();
+    return;
+
+op_JMP:
+    pc = pc->target;
+    DISPATCH();
+
+op_CJMPZ:
+    SYNC();
+    if (UNBOX(Checked ? interp.vstack_pop() : *regs.sp++) == 0) {
+        pc = pc->target;
+        DISPATCH();
+    }
+    NEXT();
+
+op_CJMPNZ:
+    SYNC();
+    if (UNBOX(Checked ? interp.vstack_pop() : *regs.sp++) != 0) {
+        pc = pc->target;
+        DISPATCH();
+    }
+    NEXT();
+
+op_CALL:
+    SAVE();
+    SYNC();
+    interp.verify_vstack(SP + pc->a, ".call");
+    interp.call(reinterpret_cast<aint>(pc + 1), pc->b != 0);
+    LOAD(false);
+    pc = pc->target;
+    DISPATCH();
+
+op_CALLC:
+    SAVE();
+    SYNC();
+    pc = enterClosure(code, interp, pc);
+    LOAD(false);
+    DISPATCH();
+
+op_END:
+    SAVE();
+    SYNC();
+    pc = reinterpret_cast<Decoded *>(interp.leave());
+    LOAD(true);
+    DISPATCH();
+
+op_TAIL_CALL:
+    SAVE();
+    SYNC();
+    interp.tailCall(pc->a, pc->b != 0);
+    LOAD(false);
+    pc = pc->target;
+    DISPATCH();
+
+op_TAIL_CALLC:
+    SAVE();
+    SYNC();
+    pc = tailClosure(code, interp, pc);
+    LOAD(false);
+    DISPATCH();
+
+op_SWITCH:
+    SAVE();
+    SYNC();
+    pc = selectCase(interp, pc);
+    LOAD(false);
+    DISPATCH();
+
+op_UNPACK:
+    SAVE();
+    SYNC();
+    pc = unpack(interp, pc);
+    LOAD(false);
+    DISPATCH();
+
+op_NATIVE:
+    SAVE();
+    pc = code.enter(pc->native);
+    LOAD(true);
+    DISPATCH();
+
+op_COUNT:
+    SAVE();
+    if (auto *next = tracer->hit(pc)) {
+        LOAD(true);
+        pc = next;
+        DISPATCH();
+    }
+    goto *tracer->handlers[pc - code.insns.data()];
+
+#undef SUPER_HANDLER
+#undef HANDLER
+#undef STEP
+#undef NEXT
+#undef DISPATCH
+#undef LOAD
+#undef SAVE
+#undef SYNC
+}
+
+#endif //VIRTUAL_MACHINES_THREADED_H
@@ -0,0 +1,436 @@
+#ifndef VIRTUAL_MACHINES_TRACER_H
+#define VIRTUAL_MACHINES_TRACER_H
+
+#include <vector>
+
+#include "common.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "threaded.h"
+
+constexpr static int TRACE_HOT_THRESHOLD = 64;
+constexpr static int TRACE_MAX_LENGTH = 1024;
+constexpr static int TRACE_MAX_ABORTS = 4;
+// Functions with more locals have them pushed by BEGIN in the interpreter
+constexpr static int TRACE_MAX_INLINE_LOCALS = 15;
+
+// Tracing tier of the threaded engine, for verified code. Heads count how many times the interpreter dispatches them:
+// targets of backward jumps, function entries, the instructions calls return to and, once traces exist, the
+// instructions their side exits leave to. Once a head gets hot, the tracer runs the following instructions itself,
+// through the entry points of the JIT, and records the path they take. Recording goes through calls and returns, and
+// stops when the path comes back to the head, reaches native code or a loop header, or gets too long.
+//
+// The trace is compiled into linear native code with the templates of the JIT, so that the arithmetic, the
+// comparisons and the moves between the operand stack and the frame are done inline, each instruction addressing the
+// frame of the function it belongs to:
+// - jumps vanish, and conditional jumps become guards on the recorded branch direction, fused into the comparison
+//   before them; tag and kind tests of patterns are guarded this way, through the branch their result decides;
+// - calls are inlined: in unchecked code, CALL pushes the frame record, BEGIN sets the frame up and END tears it down
+//   natively, since the sizes of the frames are known; the instructions that END, closure calls, SWITCH and UNPACK
+//   continue at are guarded to be the recorded ones, which also guards the arm a tag dispatch takes;
+// - coming back to the head closes the loop with a native jump, so that a recursion runs as a loop pushing frames.
+// Side exits, and the end of a trace that does not close, continue at the native code of the instruction they go to
+// when it has some, and leave to the interpreter otherwise. Heads that keep failing to give a trace stop being counted.
+template<bool Checked>
+struct Tracer {
+    struct Step {
+        Decoded *insn;
+        Decoded *next;
+    };
+
+    ThreadedCode &code;
+    Interpreter<Checked> &interp;
+    const std::vector<int> &owner; // function of every instruction, found by the verifier
+    Jit jit;
+    std::vector<int> counters;
+    std::vector<int> aborts;
+    std::vector<bool> loops; // targets of backward jumps
+    std::vector<const void *> handlers; // handlers of the heads, replaced with the counting one
+    const void *countHandler = nullptr;
+    const void *nativeHandler = nullptr;
+    std::vector<Step> trace;
+    int traces = 0;
+
+    Tracer(ThreadedCode &code, Interpreter<Checked> &interp, const std::vector<int> &owner)
+        : code(code), interp(interp), owner(owner), counters(code.insns.size(), 0), aborts(code.insns.size(), 0),
+          loops(code.insns.size(), false), handlers(code.insns.size(), nullptr) {
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    // Starts counting the dispatches of an instruction, unless it already has native code
+    void mark(Decoded *head) {
+        auto i = index(head);
+        if (owner[i] >= 0 && head->op != Op::HALT && head->native == nullptr && handlers[i] == nullptr &&
+            aborts[i] < TRACE_MAX_ABORTS) {
+            handlers[i] = head->handler;
+            head->handler = countHandler;
+        }
+    }
+
+    // Installs the counting handler on the heads of the code, given the handlers the threaded loop bound
+    void attach(const void *count, const void *native) {
+        if (!LAMA_JIT_SUPPORTED) {
+            return;
+        }
+        JitContext<Checked>::interp = &interp;
+        JitContext<Checked>::code = &code;
+        countHandler = count;
+        nativeHandler = native;
+
+        for (auto &insn: code.insns) {
+            switch (insn.op) {
+                case Op::JMP:
+                case Op::CJMPZ:
+                case Op::CJMPNZ:
+                    if (insn.target <= &insn) {
+                        loops[index(insn.target)] = true;
+                        mark(insn.target);
+                    }
+                    break;
+                case Op::BEGIN:
+                    mark(&insn);
+                    break;
+                case Op::CALL:
+                case Op::CALLC:
+                    mark(&insn + 1);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Counts a dispatch of a head. Returns the instruction to continue at if the head got hot and the tracer ran
+    // the code from it, or nullptr to run the head as usual.
+    Decoded *hit(Decoded *head) {
+        auto i = index(head);
+        if (++counters[i] < TRACE_HOT_THRESHOLD) {
+            return nullptr;
+        }
+        counters[i] = 0;
+
+        auto *next = record(head);
+        if (!trace.empty() && install(head)) {
+            head->handler = nativeHandler;
+            handlers[i] = nullptr;
+            traces++;
+        } else if (++aborts[i] >= TRACE_MAX_ABORTS) {
+            head->handler = handlers[i];
+            handlers[i] = nullptr;
+        }
+        return next;
+    }
+
+    // Whether recording stops before an instruction
+    bool ends(const Decoded *head, const Decoded *next) const {
+        return next == head || next->native != nullptr || loops[index(next)] ||
+               static_cast<int>(trace.size()) >= TRACE_MAX_LENGTH;
+    }
+
+    // Runs the instructions starting from the head and records them, until one that ends the trace. Returns the
+    // instruction to continue at, with the trace left empty if the program halts first.
+    Decoded *record(Decoded *head) {
+        trace.clear();
+        auto *pc = head;
+        do {
+            Decoded *next;
+            switch (pc->op) {
+                case Op::HALT:
+                    trace.clear();
+                    return pc;
+                case Op::JMP:
+                    next = pc->target;
+                    break;
+                case Op::CJMPZ:
+                case Op::CJMPNZ: {
+                    auto zero = jitCondition<Checked>(pc) == 0;
+                    next = zero == (pc->op == Op::CJMPZ) ? pc->target : pc + 1;
+                    break;
+                }
+                case Op::CALL:
+                    jitCall<Checked>(pc);
+                    next = pc->target;
+                    break;
+                case Op::TAIL_CALL:
+                    jitTailCall<Checked>(pc);
+                    next = pc->target;
+                    break;
+                case Op::CALLC:
+                    next = jitCallC<Checked>(pc);
+                    break;
+                case Op::TAIL_CALLC:
+                    next = jitTailCallC<Checked>(pc);
+                    break;
+                case Op::END:
+                    next = jitEnd<Checked>(pc);
+                    break;
+                case Op::SWITCH:
+                    next = jitSwitch<Checked>(pc);
+                    break;
+                case Op::UNPACK:
+                    next = jitUnpack<Checked>(pc);
+                    break;
+                default:
+                    jitStepOf<Checked>(pc->op)(pc);
+                    next = pc + 1;
+                    break;
+            }
+            trace.push_back({pc, next});
+            pc = next;
+        } while (!ends(head, pc));
+        return pc;
+    }
+
+    // Displacement of a frame field of the interpreter from its frame pointer, which native frame code addresses them
+    // through
+    int32_t field(const void *address) const {
+        return static_cast<int32_t>(static_cast<const char *>(address) - reinterpret_cast<const char *>(&interp.fp));
+    }
+
+    // mov rdx, &interp.fp
+    void fields() {
+        jit.bytes({0x48, 0xBA});
+        jit.imm64(&interp.fp);
+    }
+
+    // Pushes the frame record of a CALL made by the function starting with `begin`, as `Interpreter::call` does
+    void pushFrame(const Decoded *insn, const Decoded *begin) {
+        fields();
+        // mov rax, pc + 1; mov [r12 - 8], rax; mov [r12 - 16], r13
+        jit.bytes({0x48, 0xB8});
+        jit.imm64(insn + 1);
+        jit.bytes({0x49, 0x89, 0x44, 0x24, 0xF8, 0x4D, 0x89, 0x6C, 0x24, 0xF0});
+        // movzx eax, byte [rdx + closure]; mov rcx, meta; lea rax, [rcx + rax * 2]; mov [r12 - 24], rax
+        jit.bytes({0x0F, 0xB6, 0x82});
+        jit.imm32(field(&interp.frame_closure));
+        jit.bytes({0x48, 0xB9});
+        auto meta = static_cast<auint>(begin->b) << 32 | static_cast<auint>(begin->a) << 2 | 1;
+        jit.imm64(reinterpret_cast<const void *>(meta));
+        jit.bytes({0x48, 0x8D, 0x04, 0x41, 0x49, 0x89, 0x44, 0x24, 0xE8});
+        // mov byte [rdx + closure], b
+        jit.bytes({0xC6, 0x82});
+        jit.imm32(field(&interp.frame_closure));
+        jit.bytes({static_cast<unsigned char>(insn->b != 0)});
+        jit.pop(-FRAME_WORDS);
+    }
+
+    // Sets the frame of a BEGIN up, as `Interpreter::processBegin` does, leaving to its entry point to report a stack
+    // overflow
+    void enterFrame(const Decoded *insn) {
+        if (insn->depth >= 0) {
+            // lea rax, [r12 - 8 * (nlocals + depth + FRAME_WORDS)]; mov rcx, vstack; cmp rax, rcx; ja ok
+            jit.bytes({0x49, 0x8D, 0x84, 0x24});
+            jit.imm32(-8 * (insn->b + insn->depth + FRAME_WORDS));
+            jit.bytes({0x48, 0xB9});
+            jit.imm64(vstack);
+            jit.bytes({0x48, 0x39, 0xC8, 0x77, 0x00});
+            auto at = jit.buffer.size();
+            jit.call(reinterpret_cast<const void *>(jitStepOf<Checked>(Op::BEGIN)), insn, true);
+            jit.buffer[at - 1] = static_cast<unsigned char>(jit.buffer.size() - at);
+        }
+        fields();
+        // mov [rdx + fp], r12; mov dword [rdx + nargs], a; mov dword [rdx + nlocals], b; mov r13, r12
+        jit.bytes({0x4C, 0x89, 0xA2});
+        jit.imm32(field(&interp.fp));
+        jit.bytes({0xC7, 0x82});
+        jit.imm32(field(&interp.frame_nargs));
+        jit.imm32(insn->a);
+        jit.bytes({0xC7, 0x82});
+        jit.imm32(field(&interp.frame_nlocals));
+        jit.imm32(insn->b);
+        jit.bytes({0x4D, 0x89, 0xE5});
+        for (int i = 0; i < insn->b; i++) {
+            // mov qword [r12 - 8 * (i + 1)], BOX(0)
+            jit.bytes({0x49, 0xC7, 0x44, 0x24, static_cast<unsigned char>(-8 * (i + 1))});
+            jit.imm32(BOX(0));
+        }
+        jit.pop(-insn->b);
+    }
+
+    // Tears down the frame of the function starting with `begin`, as `Interpreter::leave` does, and leaves its return
+    // address in rax
+    void leaveFrame(const Decoded *begin) {
+        fields();
+        // movzx ecx, byte [rdx + closure]; mov rsi, [r12]; lea rax, [r13 - 8 * nlocals]; cmp r12, rax
+        jit.bytes({0x0F, 0xB6, 0x8A});
+        jit.imm32(field(&interp.frame_closure));
+        jit.bytes({0x49, 0x8B, 0x34, 0x24, 0x49, 0x8D, 0x85});
+        jit.imm32(-8 * begin->b);
+        jit.bytes({0x49, 0x39, 0xC4});
+        // lea rax, [r13 + rcx * 8 + 8 * (FRAME_WORDS + nargs)], the stack pointer of the caller after the call
+        jit.bytes({0x49, 0x8D, 0x84, 0xCD});
+        jit.imm32(8 * (FRAME_WORDS + begin->a));
+        // jae +7; lea rax, [rax - 8]; mov [rax], rsi: the return value, if the operand stack is not empty
+        jit.bytes({0x73, 0x07, 0x48, 0x8D, 0x40, 0xF8, 0x48, 0x89, 0x30});
+        // mov rcx, [r13]; mov rdi, [r13 + 8]; mov r8, [r13 + 16]; mov r12, rax
+        jit.bytes({0x49, 0x8B, 0x4D, 0x00, 0x49, 0x8B, 0x7D, 0x08, 0x4D, 0x8B, 0x45, 0x10, 0x49, 0x89, 0xC4});
+        // mov [rdx + fp], rdi; mov r13, rdi
+        jit.bytes({0x48, 0x89, 0xBA});
+        jit.imm32(field(&interp.fp));
+        jit.bytes({0x49, 0x89, 0xFD});
+        // mov rax, rcx; shr rax, 32; mov [rdx + nlocals], eax
+        jit.bytes({0x48, 0x89, 0xC8, 0x48, 0xC1, 0xE8, 0x20, 0x89, 0x82});
+        jit.imm32(field(&interp.frame_nlocals));
+        // mov eax, ecx; shr eax, 2; mov [rdx + nargs], eax
+        jit.bytes({0x89, 0xC8, 0xC1, 0xE8, 0x02, 0x89, 0x82});
+        jit.imm32(field(&interp.frame_nargs));
+        // shr ecx, 1; and ecx, 1; mov [rdx + closure], cl
+        jit.bytes({0xD1, 0xE9, 0x83, 0xE1, 0x01, 0x88, 0x8A});
+        jit.imm32(field(&interp.frame_closure));
+        // <sync>; mov rax, r8
+        jit.sync();
+        jit.bytes({0x4C, 0x89, 0xC0});
+    }
+
+    // Continues at an instruction, natively if it has native code: <sync>; mov rax, insn; <resume>
+    void continueAt(const Decoded *insn) {
+        jit.sync();
+        jit.bytes({0x48, 0xB8});
+        jit.imm64(insn);
+        jit.resume();
+    }
+
+    // Compiles the recorded trace and makes it the native code of its head
+    bool install(Decoded *head) {
+        jit.buffer.clear();
+        if (code.enter == nullptr) {
+            jit.trampoline(&interp.fp);
+            code.enter = reinterpret_cast<Decoded *(*)(const void *)>(jit.install());
+            if (code.enter == nullptr) {
+                return false;
+            }
+        }
+        jit.fp = &interp.fp;
+
+        std::vector<std::pair<size_t, Decoded *>> exits; // rel32 to patch -> instruction the side exit goes to
+        std::vector<size_t> resumes; // rel32 to patch -> continue at the instruction in rax
+        auto guard = [&](unsigned char cc, Decoded *target) {
+            jit.bytes({0x0F, static_cast<unsigned char>(0x80 + cc)});
+            exits.emplace_back(jit.buffer.size(), target);
+            jit.imm32(0);
+        };
+
+        for (size_t i = 0; i < trace.size(); i++) {
+            auto [insn, next] = trace[i];
+            auto *begin = code.insns[owner[index(insn)]].op == Op::BEGIN ? &code.insns[owner[index(insn)]] : nullptr;
+            switch (insn->op) {
+                case Op::JMP:
+                    break;
+                case Op::CALL:
+                    if (!Checked && begin != nullptr) {
+                        pushFrame(insn, begin);
+                    } else {
+                        jit.call(reinterpret_cast<const void *>(&jitCall<Checked>), insn);
+                    }
+                    break;
+                case Op::BEGIN:
+                    if (!Checked && insn->b <= TRACE_MAX_INLINE_LOCALS) {
+                        enterFrame(insn);
+                    } else {
+                        jit.step<Checked>(*insn, begin);
+                    }
+                    break;
+                case Op::TAIL_CALL:
+                    jit.call(reinterpret_cast<const void *>(&jitTailCall<Checked>), insn);
+                    break;
+                case Op::CJMPZ:
+                case Op::CJMPNZ: {
+                    jit.condition<Checked>(*insn);
+                    if (insn->target == insn + 1) {
+                        break;
+                    }
+                    // je or jne to the side exit, depending on which way the operand did not go
+                    auto taken = next == insn->target;
+                    auto exitOnZero = (insn->op == Op::CJMPZ) != taken;
+                    guard(exitOnZero ? 0x4 : 0x5, taken ? insn + 1 : insn->target);
+                    break;
+                }
+                case Op::CALLC:
+                case Op::TAIL_CALLC:
+                case Op::END:
+                case Op::SWITCH:
+                case Op::UNPACK: {
+                    auto *fn = insn->op == Op::END ? reinterpret_cast<const void *>(&jitEnd<Checked>)
+                               : insn->op == Op::SWITCH ? reinterpret_cast<const void *>(&jitSwitch<Checked>)
+                               : insn->op == Op::UNPACK ? reinterpret_cast<const void *>(&jitUnpack<Checked>)
+                               : insn->op == Op::CALLC ? reinterpret_cast<const void *>(&jitCallC<Checked>)
+                               : reinterpret_cast<const void *>(&jitTailCallC<Checked>);
+                    if (!Checked && insn->op == Op::END && begin != nullptr) {
+                        leaveFrame(begin);
+                    } else {
+                        jit.call(fn, insn, insn->op == Op::END);
+                    }
+                    if (i + 1 == trace.size()) {
+                        // the trace ends here anyway, wherever the instruction continues
+                        jit.resume();
+                        return finish(head, exits, resumes);
+                    }
+                    // mov rcx, next; cmp rax, rcx; jne resume
+                    jit.bytes({0x48, 0xB9});
+                    jit.imm64(next);
+                    jit.bytes({0x48, 0x39, 0xC8, 0x0F, 0x85});
+                    resumes.push_back(jit.buffer.size());
+                    jit.imm32(0);
+                    break;
+                }
+                default: {
+                    auto cc = Jit::conditionCode(insn->op);
+                    if (!Checked && cc >= 0 && i + 1 < trace.size() &&
+                        (trace[i + 1].insn->op == Op::CJMPZ || trace[i + 1].insn->op == Op::CJMPNZ) &&
+                        trace[i + 1].insn == insn + 1 && insn[1].target != insn + 2) {
+                        // the comparison and the guard of the conditional jump after it: cmp rax, rcx; jcc exit
+                        auto &cjmp = insn[1];
+                        auto taken = trace[i + 1].next == cjmp.target;
+                        auto jumps = cc ^ (cjmp.op == Op::CJMPZ ? 1 : 0);
+                        jit.operands(insn->op);
+                        jit.pop(2);
+                        jit.bytes({0x48, 0x39, 0xC8});
+                        guard(static_cast<unsigned char>(taken ? jumps ^ 1 : jumps), taken ? &cjmp + 1 : cjmp.target);
+                        i++;
+                        break;
+                    }
+                    jit.step<Checked>(*insn, begin);
+                    break;
+                }
+            }
+        }
+        if (trace.back().next == head) {
+            jit.bytes({0xE9});
+            jit.imm32(static_cast<int32_t>(-(jit.buffer.size() + 4)));
+        } else {
+            continueAt(trace.back().next);
+        }
+        return finish(head, exits, resumes);
+    }
+
+    // Lays out the side exits and installs the code
+    bool finish(Decoded *head, const std::vector<std::pair<size_t, Decoded *>> &exits,
+                const std::vector<size_t> &resumes) {
+        for (auto &[at, target]: exits) {
+            jit.patch32(at, static_cast<int32_t>(jit.buffer.size() - (at + 4)));
+            continueAt(target);
+        }
+        if (!resumes.empty()) {
+            for (auto at: resumes) {
+                jit.patch32(at, static_cast<int32_t>(jit.buffer.size() - (at + 4)));
+            }
+            jit.resume();
+        }
+
+        auto *memory = jit.install();
+        if (memory == nullptr) {
+            return false;
+        }
+        DEBUG("Trace of %zu instructions from 0x%.8lx\n", trace.size(), head->ip - code.bf->code_ptr);
+        head->native = memory;
+        for (auto &[at, target]: exits) {
+            mark(target);
+        }
+        return true;
+    }
+};
+
+#endif //VIRTUAL_MACHINES_TRACER_H
@@ -0,0 +1,263 @@
+#ifndef VIRTUAL_MACHINES_VERIFIER_H
+#define VIRTUAL_MACHINES_VERIFIER_H
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "threaded.h"
+
+// Number of operand stack values an instruction consumes and produces
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+inline StackEffect stackEffect(const Decoded &insn) {
+    switch (insn.op) {
+        case Op::ADD: case Op::SUB: case Op::MUL: case Op::DIV: case Op::MOD: case Op::LT: case Op::LTQ:
+        case Op::GT: case Op::GTQ: case Op::EQ: case Op::NEQ: case Op::AND: case Op::OR:
+        case Op::ADD_INT: case Op::SUB_INT: case Op::MUL_INT: case Op::LT_INT: case Op::LTQ_INT: case Op::GT_INT:
+        case Op::GTQ_INT: case Op::EQ_INT: case Op::NEQ_INT:
+        case Op::ELEM:
+        case Op::PATT_STR:
+            return {2, 1};
+        case Op::CONST: case Op::STRING: case Op::CLOSURE: case Op::LREAD:
+        case Op::LD_G: case Op::LD_L: case Op::LD_A: case Op::LD_C:
+            return {0, 1};
+        case Op::ST_G: case Op::ST_L: case Op::ST_A: case Op::ST_C:
+        case Op::TAG: case Op::ARRAY: case Op::LWRITE: case Op::LLENGTH:
+        case Op::PATT_STR_TAG: case Op::PATT_ARRAY: case Op::PATT_SEXP: case Op::PATT_BOXED:
+        case Op::PATT_UNBOXED: case Op::PATT_CLOSURE:
+            return {1, 1};
+        case Op::SEXP: case Op::BARRAY:
+            return {insn.a, 1};
+        case Op::CALL: case Op::TAIL_CALL:
+            return {insn.a + insn.b, 1};
+        case Op::CALLC: case Op::TAIL_CALLC:
+            return {insn.a + 1, 1};
+        case Op::STA:
+            return {3, 1};
+        case Op::DROP: case Op::CJMPZ: case Op::CJMPNZ: case Op::END:
+            return {1, 0};
+        case Op::DUP:
+            return {1, 2};
+        case Op::SWAP:
+            return {2, 2};
+        case Op::LSTRING:
+            return {1, 2}; // the argument stays on the stack
+        default:
+            return {0, 0};
+    }
+}
+
+// Instructions that never pass control to the next one. STI, RET, LDA and unknown patterns always fail, and tail calls
+// return to the caller of their function.
+inline bool isTerminator(Op op) {
+    switch (op) {
+        case Op::HALT: case Op::JMP: case Op::END: case Op::TAIL_CALL: case Op::TAIL_CALLC: case Op::FAIL:
+        case Op::STI: case Op::RET: case Op::LDA: case Op::PATT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Proves once, at load time, the properties that the checked interpreter verifies on every executed instruction:
+// - every function entry (public symbol, CALL or CLOSURE target) is a BEGIN, and no other control flow reaches one;
+// - every instruction belongs to a single function and has the same operand stack depth on every path to it;
+// - no instruction pops more values than its function has pushed, so END always has a return value;
+// - global, argument, local and captured variable indices are in bounds, where captures are only accessed by
+//   functions that are exclusively entered through closures having enough of them;
+// - CALL passes as many arguments as its target expects, and string operands are terminated in the string table.
+// The number of captures a function reads is recorded into the `c` operand of its BEGIN, and the maximum depth its
+// operand stack reaches, including the values instructions push temporarily, into `depth`.
+struct Verifier {
+    ThreadedCode &code;
+    std::vector<int> depth;
+    std::vector<int> owner;
+    const char *reason = nullptr;
+
+    explicit Verifier(ThreadedCode &code)
+        : code(code), depth(code.insns.size(), -1), owner(code.insns.size(), -1) {
+    }
+
+    int index(const Decoded *insn) const {
+        return static_cast<int>(insn - code.insns.data());
+    }
+
+    bool reject(const char *why, [[maybe_unused]] const Decoded &insn) {
+        reason = why;
+        DEBUG("Verification failed at 0x%.8lx: %s\n", get_original_offset(code.bf, insn.ip - code.bf->code_ptr), why);
+        return false;
+    }
+
+    bool verifyString(const char *str) const {
+        auto pos = str - code.bf->string_ptr;
+        return pos >= 0 && pos < code.bf->stringtab_size &&
+               std::memchr(str, 0, code.bf->stringtab_size - pos) != nullptr;
+    }
+
+    bool verifyLoc(Loc::Type type, int value, int nargs, int nlocals, int ncaptures) const {
+        if (value < 0) {
+            return false;
+        }
+        switch (type) {
+            case Loc::Type::G:
+                return value < code.bf->global_area_size;
+            case Loc::Type::L:
+                return value < nlocals;
+            case Loc::Type::A:
+                return value < nargs;
+            case Loc::Type::C:
+                return value < ncaptures;
+        }
+        return false;
+    }
+
+    bool verify() {
+        auto n = code.insns.size();
+        std::vector<bool> called(n, false);
+        std::vector<int> captures(n, INT_MAX);
+        std::vector<int> entries;
+
+        auto addEntry = [&](const Decoded *insn) {
+            if (owner[index(insn)] < 0) {
+                owner[index(insn)] = index(insn);
+                entries.push_back(index(insn));
+            }
+        };
+
+        for (int i = 0; i < code.bf->public_symbols_number; i++) {
+            auto *insn = code.entry(get_public_offset(code.bf, i));
+            called[index(insn)] = true;
+            addEntry(insn);
+        }
+        for (auto &insn: code.insns) {
+            if (insn.op == Op::CALL || insn.op == Op::TAIL_CALL) {
+                called[index(insn.target)] = true;
+                addEntry(insn.target);
+                if (insn.target->op == Op::BEGIN && insn.target->a != insn.a) {
+                    return reject("CALL passes a wrong number of arguments", insn);
+                }
+            } else if (insn.op == Op::CLOSURE) {
+                auto *target = code.entry(insn.jump);
+                captures[index(target)] = std::min(captures[index(target)], insn.a);
+                addEntry(target);
+            } else if (insn.op == Op::STRING || insn.op == Op::SEXP || insn.op == Op::TAG) {
+                if (!verifyString(insn.str)) {
+                    return reject("string operand is out of the string table", insn);
+                }
+            }
+        }
+
+        auto *main = code.entry(code.bf->entrypoint_ptr - code.bf->code_ptr);
+        if (main->op == Op::BEGIN && main->a > 2) {
+            return reject("main expects more than argc and argv", *main);
+        }
+
+        for (auto e: entries) {
+            auto &begin = code.insns[e];
+            if (begin.op != Op::BEGIN) {
+                return reject("function does not start with BEGIN", begin);
+            }
+            if (begin.a < 0 || begin.b < 0) {
+                return reject("negative number of arguments or locals", begin);
+            }
+            begin.c = 0;
+            begin.depth = 0;
+            if (!verifyFunction(e, called[e] ? 0 : captures[e])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool verifyFunction(int entry, int ncaptures) {
+        auto &begin = code.insns[entry];
+        auto nargs = begin.a, nlocals = begin.b;
+
+        std::vector<std::pair<int, int>> worklist = {{entry + 1, 0}};
+        while (!worklist.empty()) {
+            auto [i, d] = worklist.back();
+            worklist.pop_back();
+
+            auto &insn = code.insns[i];
+            if (owner[i] >= 0 && owner[i] != entry) {
+                return reject(insn.op == Op::BEGIN ? "control flow reaches a function prologue"
+                                                   : "code is shared between functions", insn);
+            }
+            if (owner[i] == entry) {
+                if (depth[i] != d) {
+                    return reject("inconsistent stack depth", insn);
+                }
+                continue;
+            }
+            owner[i] = entry;
+            depth[i] = d;
+
+            switch (insn.op) {
+                case Op::LD_G: case Op::LD_L: case Op::LD_A: case Op::LD_C:
+                    if (!verifyLoc(static_cast<Loc::Type>(static_cast<int>(insn.op) - static_cast<int>(Op::LD_G)),
+                                   insn.a, nargs, nlocals, ncaptures)) {
+                        return reject("location is out of bounds", insn);
+                    }
+                    break;
+                case Op::ST_G: case Op::ST_L: case Op::ST_A: case Op::ST_C:
+                    if (!verifyLoc(static_cast<Loc::Type>(static_cast<int>(insn.op) - static_cast<int>(Op::ST_G)),
+                                   insn.a, nargs, nlocals, ncaptures)) {
+                        return reject("location is out of bounds", insn);
+                    }
+                    break;
+                case Op::CLOSURE:
+                    for (int j = 0; j < insn.a; j++) {
+                        auto &loc = insn.locs[j];
+                        if (!verifyLoc(loc.type, loc.value, nargs, nlocals, ncaptures)) {
+                            return reject("captured location is out of bounds", insn);
+                        }
+                    }
+                    break;
+                default:
+                    break;
+            }
+            if (insn.op == Op::LD_C || insn.op == Op::ST_C) {
+                begin.c = std::max(begin.c, insn.a + 1);
+            } else if (insn.op == Op::CLOSURE) {
+                for (int j = 0; j < insn.a; j++) {
+                    if (insn.locs[j].type == Loc::Type::C) {
+                        begin.c = std::max(begin.c, insn.locs[j].value + 1);
+                    }
+                }
+            }
+
+            auto [pops, pushes] = stackEffect(insn);
+            if (pops < 0 || (insn.op == Op::CLOSURE && insn.a < 0)) {
+                return reject("negative operand count", insn);
+            }
+            if (d < pops) {
+                return reject("operand stack underflow", insn);
+            }
+            auto next = d - pops + pushes;
+            auto peak = next;
+            if (insn.op == Op::SEXP || insn.op == Op::DUP || insn.op == Op::LSTRING) {
+                peak = std::max(peak, d + 1);
+            } else if (insn.op == Op::CLOSURE) {
+                peak = d + insn.a + 1; // the captured values and the target
+            }
+            begin.depth = std::max(begin.depth, peak);
+
+            if (insn.op == Op::JMP || insn.op == Op::CJMPZ || insn.op == Op::CJMPNZ) {
+                worklist.emplace_back(index(insn.target), next);
+            }
+            if (!isTerminator(insn.op)) {
+                worklist.emplace_back(i + 1, next);
+            }
+        }
+        return true;
+    }
+};
+
+#endif //VIRTUAL_MACHINES_VERIFIER_H